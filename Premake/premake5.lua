@@ -50,6 +50,49 @@ project ("Croissant-Renderer")
             "OpenGL.framework",
         }
 
+    -- Linux
+    filter { "system:linux" }
+        links { "pthread" }
+
+    filter { "configurations:Debug" }
+        defines { "DEBUG" }
+        symbols ("On")
+
+    filter { "configurations:Release" }
+        defines { "NDEBUG" }
+        optimize ("On")
+
+    filter {}
+
+    cppdialect "c++17"
+
+
+-------------------------------------------------------
+--  Headless renderer (no window system)
+-------------------------------------------------------
+
+project ("Croissant-Headless")
+    kind ("ConsoleApp")
+    language ("C++")
+
+    targetdir (_OUT_DIR)
+    objdir (_OBJ_DIR.."/headless")
+
+    includeExternal()
+    includedirs { _SRC_DIR }
+
+    -- Renderer core, replacing the GLFW viewport entry point
+    files {
+        _SRC_DIR.."/*.h",
+        _SRC_DIR.."/*.cpp",
+        _SRC_DIR.."/Headless/*.cpp"
+    }
+    removefiles { _SRC_DIR.."/main.cpp" }
+
+    -- Linux
+    filter { "system:linux" }
+        links { "pthread" }
+
     filter { "configurations:Debug" }
         defines { "DEBUG" }
         symbols ("On")
@@ -0,0 +1,475 @@
+/*************************************************************************
+*
+*		Headless/main.cpp
+*
+*		Command-line entry point without any window-system dependency,
+*		for render farm nodes. Renders the scene once and writes the
+*		result to disk, or merges partial accumulation buffers rendered
+*		by independent nodes into one image.
+*
+**************************************************************************/
+
+#include "renderer.h"
+#include "render_queue.h"
+#include "distributed.h"
+#include "image.h"
+
+#include "glm/gtc/constants.hpp"   // pi
+
+#include <chrono>   // steady_clock
+#include <cstdint>  // UINT32_MAX
+#include <cstdlib>  // strtol
+#include <cstring>  // strcmp
+
+//----------------------------------------------------
+
+struct SHeadlessArgs
+{
+    const char*     scene = "Model/Croissants_obj/Croissant.obj";
+    const char*     output = "MyRender.png";
+    float           timeLimit = 0.f;    // seconds, 0 -> full render
+    u_int32_t       turntable = 0;      // frames, 0 -> single image
+    u_int32_t       nProcesses = 0;     // worker processes, 0 -> in-process
+    const char*     saveAccum = nullptr;    // raw accumulation output, .cracc
+    std::vector<const char*>    merge;      // accumulation files to merge
+};
+
+//----------------------------------------------------
+
+void printUsage(const char* exe)
+{
+    printf("Usage: %s [options]\n", exe);
+    printf("  --width <px>          image width (default 800)\n");
+    printf("  --height <px>         image height (default 600)\n");
+    printf("  --samples <n>         samples per pixel (default 9)\n");
+    printf("  --depth <n>           max ray depth (default 10)\n");
+    printf("  --threads <n>         worker threads, 0 -> all cores (default 0)\n");
+    printf("  --tile <px>           tile size (default 32)\n");
+    printf("  --order <name>        scanline | morton | hilbert (default hilbert)\n");
+    printf("  --pin                 pin workers to cpus, NUMA first-touch\n");
+    printf("  --replicate           replicate scene data per NUMA node\n");
+    printf("  --serial-bvh          build bvh-trees on one thread, for comparison\n");
+    printf("  --mesh-bvh <name>     sah | sbvh | ploc | hlbvh | lbvh | midpoint | equal,\n");
+    printf("                        builder of the mesh bvh-tree (default sah)\n");
+    printf("  --mesh-cache          load the mesh and its bvh-tree from <obj>.crcache,\n");
+    printf("                        written on the first run\n");
+    printf("  --compress-bvh        8-bit quantized bvh-tree nodes, less memory traffic\n");
+    printf("  --optimize-bvh        restructure the bvh-trees after building them,\n");
+    printf("                        slower builds for faster static renders\n");
+    printf("  --instances <n>       scatter n more instances of the mesh\n");
+    printf("  --time-limit <sec>    progressive render, stop after the limit\n");
+    printf("  --turntable <frames>  queue one job per frame orbiting the scene,\n");
+    printf("                        writes <output>_<frame>.<ext>\n");
+    printf("  --procs <n>           render tiles in n forked worker processes,\n");
+    printf("                        --threads is then per process\n");
+    printf("  --sample-begin <n>    first sample index to render (default 0)\n");
+    printf("  --sample-end <n>      end of the sample range (default --samples)\n");
+    printf("  --save-accum <file>   also write the raw accumulation buffer, to be\n");
+    printf("                        merged with other sample ranges later\n");
+    printf("  --merge <file>        sum an accumulation buffer instead of rendering,\n");
+    printf("                        repeat for every partial render\n");
+    printf("  --scene <file.obj>    mesh to render\n");
+    printf("  --output <file>       .png, .jpg, .bmp or .tga (default MyRender.png),\n");
+    printf("                        .cracc keeps a merged result mergeable\n");
+}
+
+//----------------------------------------------------
+
+// whole decimal numbers only, "minValue" is 0 where 0 selects a default
+bool parseCount(const char* arg, const char* value, u_int32_t minValue, u_int32_t &outCount)
+{
+    char*   end;
+    long    count = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || count < (long)minValue || count > (long)UINT32_MAX)
+    {
+        printf("[Headless] Error: \"%s\" needs a %s number, got \"%s\"\n", arg, minValue > 0 ? "positive" : "non-negative", value);
+        return false;
+    }
+
+    outCount = (u_int32_t)count;
+    return true;
+}
+
+//----------------------------------------------------
+
+bool parseArgs(int argc, char** argv, cr::SRenderSetting &renderSetting, SHeadlessArgs &args)
+{
+    // last option that only affects rendering, which a merge would ignore
+    const char*     renderOption = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char*     arg = argv[i];
+        const char*     value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (strcmp(arg, "--merge") != 0 && strcmp(arg, "--output") != 0)
+            renderOption = arg;
+
+        // flags without value
+        if (strcmp(arg, "--pin") == 0)
+        {
+            renderSetting.pinThreads = true;
+            continue;
+        }
+        if (strcmp(arg, "--replicate") == 0)
+        {
+            renderSetting.replicateScene = true;
+            continue;
+        }
+        if (strcmp(arg, "--serial-bvh") == 0)
+        {
+            renderSetting.parallelBvhBuild = false;
+            continue;
+        }
+        if (strcmp(arg, "--mesh-cache") == 0)
+        {
+            renderSetting.meshCache = true;
+            continue;
+        }
+        if (strcmp(arg, "--compress-bvh") == 0)
+        {
+            renderSetting.compressBvh = true;
+            continue;
+        }
+        if (strcmp(arg, "--optimize-bvh") == 0)
+        {
+            renderSetting.restructureBvh = true;
+            continue;
+        }
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0)
+            return false;
+
+        if (value == nullptr)
+        {
+            printf("[Headless] Error: Missing value for \"%s\"\n", arg);
+            return false;
+        }
+        i++;
+
+        if (strcmp(arg, "--width") == 0)
+        {
+            if (!parseCount(arg, value, 1, renderSetting.render_w))
+                return false;
+        }
+        else if (strcmp(arg, "--height") == 0)
+        {
+            if (!parseCount(arg, value, 1, renderSetting.render_h))
+                return false;
+        }
+        else if (strcmp(arg, "--samples") == 0)
+        {
+            if (!parseCount(arg, value, 1, renderSetting.nSamples))
+                return false;
+        }
+        else if (strcmp(arg, "--depth") == 0)
+        {
+            if (!parseCount(arg, value, 1, renderSetting.nMaxDepth))
+                return false;
+        }
+        else if (strcmp(arg, "--threads") == 0)
+        {
+            if (!parseCount(arg, value, 0, renderSetting.nThreads))
+                return false;
+        }
+        else if (strcmp(arg, "--tile") == 0)
+        {
+            if (!parseCount(arg, value, 1, renderSetting.tileSize))
+                return false;
+        }
+        else if (strcmp(arg, "--order") == 0)
+        {
+            if (strcmp(value, "scanline") == 0)
+                renderSetting.pixelOrder = cr::SCANLINE;
+            else if (strcmp(value, "morton") == 0)
+                renderSetting.pixelOrder = cr::MORTON;
+            else if (strcmp(value, "hilbert") == 0)
+                renderSetting.pixelOrder = cr::HILBERT;
+            else
+            {
+                printf("[Headless] Error: Unknown order \"%s\"\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--mesh-bvh") == 0)
+        {
+            if (strcmp(value, "sah") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::SAH;
+            else if (strcmp(value, "sbvh") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::SBVH;
+            else if (strcmp(value, "hlbvh") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::HLBVH;
+            else if (strcmp(value, "lbvh") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::LBVH;
+            else if (strcmp(value, "ploc") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::PLOC;
+            else if (strcmp(value, "midpoint") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::MIDPOINT;
+            else if (strcmp(value, "equal") == 0)
+                renderSetting.meshPartition = cr::CBVHAccel::EQUALSUBSET;
+            else
+            {
+                printf("[Headless] Error: Unknown bvh builder \"%s\"\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--instances") == 0)
+        {
+            if (!parseCount(arg, value, 0, renderSetting.nMeshInstances))
+                return false;
+        }
+        else if (strcmp(arg, "--time-limit") == 0)
+        {
+            args.timeLimit = atof(value);
+            if (!(args.timeLimit > 0.f))
+            {
+                printf("[Headless] Error: \"%s\" needs a positive number of seconds, got \"%s\"\n", arg, value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--turntable") == 0)
+        {
+            if (!parseCount(arg, value, 0, args.turntable))
+                return false;
+        }
+        else if (strcmp(arg, "--procs") == 0)
+        {
+            if (!parseCount(arg, value, 0, args.nProcesses))
+                return false;
+        }
+        else if (strcmp(arg, "--sample-begin") == 0)
+        {
+            if (!parseCount(arg, value, 0, renderSetting.sampleBegin))
+                return false;
+        }
+        else if (strcmp(arg, "--sample-end") == 0)
+        {
+            if (!parseCount(arg, value, 0, renderSetting.sampleEnd))
+                return false;
+        }
+        else if (strcmp(arg, "--save-accum") == 0)
+            args.saveAccum = value;
+        else if (strcmp(arg, "--merge") == 0)
+            args.merge.push_back(value);
+        else if (strcmp(arg, "--scene") == 0)
+            args.scene = value;
+        else if (strcmp(arg, "--output") == 0)
+            args.output = value;
+        else
+        {
+            printf("[Headless] Error: Unknown option \"%s\"\n", arg);
+            return false;
+        }
+    }
+
+    // every mode renders through its own path, reject options it would drop
+    if (!args.merge.empty() && renderOption != nullptr)
+    {
+        printf("[Headless] Error: \"--merge\" only takes \"--output\", not \"%s\"\n", renderOption);
+        return false;
+    }
+    if (args.nProcesses > 0 && (args.timeLimit > 0.f || args.turntable > 0))
+    {
+        printf("[Headless] Error: \"--procs\" cannot be combined with \"--time-limit\" or \"--turntable\"\n");
+        return false;
+    }
+    if (args.turntable > 0 && (args.timeLimit > 0.f || args.saveAccum != nullptr))
+    {
+        printf("[Headless] Error: \"--turntable\" cannot be combined with \"--time-limit\" or \"--save-accum\"\n");
+        return false;
+    }
+
+    u_int32_t   sampleEnd = renderSetting.sampleEnd > 0 ? renderSetting.sampleEnd : renderSetting.nSamples;
+    if (renderSetting.sampleBegin >= sampleEnd || sampleEnd > renderSetting.nSamples)
+    {
+        printf("[Headless] Error: Sample range must lie within [0, %u)\n", renderSetting.nSamples);
+        return false;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool endsWith(const char* str, const char* suffix)
+{
+    size_t  len = strlen(str), suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(str + len - suffixLen, suffix) == 0;
+}
+
+//----------------------------------------------------
+
+// write the display image, or the summed buffer itself for a ".cracc" output
+bool saveOutput(const char* filename, const cr::SAccumulation &acc)
+{
+    bool    success;
+    if (endsWith(filename, ".cracc"))
+        success = cr::SaveAccumulation(filename, acc);
+    else
+    {
+        std::vector<float>  pixmap(acc.accum.size());
+        cr::ResolveAccumulation(acc, pixmap.data());
+        success = cr::SaveImage(filename, pixmap.data(), acc.width, acc.height);
+    }
+
+    if (success)
+        printf("[Headless] Image saved: %s\n", filename);
+    else
+        printf("[Headless] Error while saving image: %s\n", filename);
+
+    return success;
+}
+
+//----------------------------------------------------
+
+// sample ranges are seeded by their absolute sample index, so the merged
+// buffer equals a single render of the union of all ranges
+int mergeAccumulations(const SHeadlessArgs &args)
+{
+    cr::SAccumulation   merged;
+    for (const char* file : args.merge)
+    {
+        cr::SAccumulation   acc;
+        if (!cr::LoadAccumulation(file, acc) || !cr::MergeAccumulation(merged, acc))
+            return 1;
+        printf("[Headless] Merged %s\n", file);
+    }
+
+    return saveOutput(args.output, merged) ? 0 : 1;
+}
+
+//----------------------------------------------------
+
+// all frames share the loaded scene and are scheduled on one worker pool
+int renderTurntable(cr::CRenderer &renderer, const cr::SRenderSetting &renderSetting, const SHeadlessArgs &args)
+{
+    cr::CRenderQueue    queue(renderer);
+    std::vector<int>    jobIds;
+
+    const glm::vec3     pos = renderer.GetCamera().m_origin;
+    const float         aspectRatio = (float)renderSetting.render_w / renderSetting.render_h;
+    for (u_int32_t frame = 0; frame < args.turntable; frame++)
+    {
+        float           angle = 2.f * glm::pi<float>() * frame / args.turntable;
+        cr::SRenderJob  job;
+        job.name = "frame " + std::to_string(frame);
+        job.setting = renderSetting;
+        job.camera = cr::CCamera(45.f, aspectRatio);
+        job.camera.SetPos(glm::vec3(pos.x * glm::cos(angle) - pos.z * glm::sin(angle),
+                                    pos.y,
+                                    pos.x * glm::sin(angle) + pos.z * glm::cos(angle)));
+        job.camera.LookAt(glm::vec3(0, 0, 0));
+        jobIds.push_back(queue.Submit(job));
+    }
+
+    std::string     output(args.output);
+    size_t          dot = output.find_last_of('.');
+    int             failed = 0;
+    for (u_int32_t frame = 0; frame < args.turntable; frame++)
+    {
+        std::vector<float>  pixmap;
+        queue.TakeResult(jobIds[frame], pixmap);
+
+        char    suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%03u", frame);
+        std::string     filename = output.substr(0, dot) + suffix + (dot == std::string::npos ? "" : output.substr(dot));
+
+        if (cr::SaveImage(filename.c_str(), pixmap.data(), renderSetting.render_w, renderSetting.render_h))
+            printf("[Headless] Image saved: %s\n", filename.c_str());
+        else
+        {
+            printf("[Headless] Error while saving image: %s\n", filename.c_str());
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
+
+//----------------------------------------------------
+
+// the coordinator process never loads the scene, every worker does
+int renderDistributed(const cr::SRenderSetting &renderSetting, const SHeadlessArgs &args)
+{
+    const u_int32_t     sampleBegin = renderSetting.sampleBegin;
+    const u_int32_t     sampleEnd = renderSetting.sampleEnd > 0 ? renderSetting.sampleEnd : renderSetting.nSamples;
+    const size_t        nPixels = renderSetting.render_w * renderSetting.render_h;
+
+    cr::SAccumulation   acc;
+    acc.width = renderSetting.render_w;
+    acc.height = renderSetting.render_h;
+    acc.accum.assign(nPixels * 3, 0.f);
+    acc.counts.assign(nPixels, sampleEnd - sampleBegin);
+
+    {
+        cr::CTileCoordinator    coordinator(renderSetting, args.scene, args.nProcesses);
+        if (!coordinator.Render(acc.accum.data(), sampleBegin, sampleEnd))
+            return 1;
+    }
+
+    bool    success = saveOutput(args.output, acc);
+    if (args.saveAccum != nullptr)
+        success = saveOutput(args.saveAccum, acc) && success;
+
+    return success ? 0 : 1;
+}
+
+//----------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    cr::SRenderSetting  renderSetting;
+    renderSetting.render_w = 800;
+    renderSetting.render_h = 600;
+    renderSetting.nSamples = 9;
+    renderSetting.nMaxDepth = 10;
+
+    SHeadlessArgs       args;
+    if (!parseArgs(argc, argv, renderSetting, args))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    renderSetting.nSamplesW = std::max(1, (int)glm::sqrt(renderSetting.nSamples));
+    renderSetting.nSamplesOffset = 0.5f / renderSetting.nSamplesW;
+
+    if (!args.merge.empty())
+        return mergeAccumulations(args);
+
+    // fork before any renderer threads exist
+    if (args.nProcesses > 0)
+        return renderDistributed(renderSetting, args);
+
+    // init renderer
+    cr::CRenderer       renderer;
+    renderer.SetRenderSetting(renderSetting);
+    renderer.InitScene(args.scene);
+
+    if (args.turntable > 0)
+        return renderTurntable(renderer, renderSetting, args);
+
+    if (args.timeLimit > 0.f)
+    {
+        // progressive passes in small time slices, so the limit is honored
+        // closely even when a single pass is expensive
+        auto    begin = std::chrono::steady_clock::now();
+        while (!renderer.IsFinished())
+        {
+            float   elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - begin).count();
+            float   remainingMs = 1000.f * (args.timeLimit - elapsed);
+            if (remainingMs <= 0.f)
+                break;
+            renderer.ProgressiveRender(std::min(remainingMs, 100.f));
+        }
+    }
+    else
+        renderer.FullRender();
+
+    cr::SAccumulation   acc;
+    renderer.GetAccumulation(acc);
+
+    bool    success = saveOutput(args.output, acc);
+    if (args.saveAccum != nullptr)
+        success = saveOutput(args.saveAccum, acc) && success;
+
+    return success ? 0 : 1;
+}
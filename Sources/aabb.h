@@ -3,6 +3,7 @@
 #include "common.h"
 #include "ray.h"
 
+#include <algorithm>
 #include <math.h>
 
 _CR_NAMESPACE_BEGIN
@@ -42,44 +43,31 @@ public:
             return 2;
     };
 
-    // ray intersection
-    bool    Hit(const CRay& r, float &t) const
+    // ray intersection clipped to [tMin, tMax], branchless slab test. "t" is
+    // the entry distance. NaNs from rays in a slab plane (0 * inf) are
+    // ignored by the min/max operand order.
+    bool    Hit(const STraversalRay& r, float tMin, float tMax, float &t) const
     {
-        const glm::vec3     sign(r.m_dir.x < 0, r.m_dir.y < 0, r.m_dir.z < 0);
+        const glm::vec3     &o = r.origin;
+        const glm::vec3     &invDir = r.invDir;
 
-        const glm::vec3     orig = r.m_origin;
-        const glm::vec3     invDir = 1.f / r.m_dir;
-        float tmin, tmax, tymin, tymax, tzmin, tzmax;
+        float   tEnter = tMin;
+        float   tExit = tMax;
 
-        tmin  = ((*this)[(bool)sign[0]].x - orig.x) * invDir.x;
-        tmax  = ((*this)[1 - (bool)sign[0]].x - orig.x) * invDir.x;
-        tymin = ((*this)[(bool)sign[1]].y - orig.y) * invDir.y;
-        tymax = ((*this)[1 - (bool)sign[1]].y - orig.y) * invDir.y;
+        tEnter = std::max(tEnter, ((*this)[r.octant[0]].x - o.x) * invDir.x);
+        tEnter = std::max(tEnter, ((*this)[r.octant[1]].y - o.y) * invDir.y);
+        tEnter = std::max(tEnter, ((*this)[r.octant[2]].z - o.z) * invDir.z);
+        tExit  = std::min(tExit, ((*this)[1 - r.octant[0]].x - o.x) * invDir.x);
+        tExit  = std::min(tExit, ((*this)[1 - r.octant[1]].y - o.y) * invDir.y);
+        tExit  = std::min(tExit, ((*this)[1 - r.octant[2]].z - o.z) * invDir.z);
 
-        if ((tmin > tymax) || (tymin > tmax))
-            return false;
+        t = tEnter;
 
-        if (tymin > tmin)
-            tmin = tymin;
-        if (tymax < tmax)
-            tmax = tymax;
-
-        tzmin = ((*this)[(bool)sign[2]].z - orig.z) * invDir.z;
-        tzmax = ((*this)[1 - (bool)sign[2]].z - orig.z) * invDir.z;
-
-        if ((tmin > tzmax) || (tzmin > tmax))
-            return false;
-
-        if (tzmin > tmin)
-            tmin = tzmin;
-        if (tzmax < tmax)
-            tmax = tzmax;
-
-        t = tmin;
-
-        return true;
+        return tEnter <= tExit;
     };
 
+    bool    Hit(const STraversalRay& r, float &t) const { return Hit(r, std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max(), t); }
+    bool    Hit(const CRay& r, float &t) const { return Hit(STraversalRay(r), t); }
     bool    Hit(const CRay& r) const { float f; return Hit(r, f); }
 
     // methods
@@ -1,88 +1,441 @@
 #include "bvh.h"
 #include "hittable.h"
+#include "topology.h"
+#include "thread_pool.h"
+#include "morton.h"
+
+#include <algorithm>
+#include <chrono>   // steady_clock
+#include <cmath>    // frexp, ldexp
+#include <cstring>  // memcpy
+#include <unordered_set>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
+static constexpr int    s_nBuckets = 12;                // SAH buckets
+static constexpr int    s_chunkSize = 16 * 1024;        // hittables per binning task
+static constexpr int    s_parallelSubtreeMin = 4096;    // smaller subtrees build serially
+static constexpr int    s_lbvhMaxLeafSize = 4;          // LBVH leaves, codes do not weigh splits
+static constexpr int    s_hlbvhTreeletBits = 12;        // HLBVH treelets share the top code bits
+static constexpr int    s_plocRadius = 16;              // PLOC neighbor search window, each side
+static constexpr int    s_plocMinMergeRatio = 64;       // PLOC stops once a pass merges fewer than 1 in this many
+                                                        // clusters, SAH joins the rest
+static constexpr int    s_radixBits = 8;                // digit size of the morton code sort
+static constexpr int    s_nSpatialBins = 32;            // SBVH spatial split candidates
+static constexpr float  s_sbvhMaxGrowth = 0.5f;         // SBVH duplicated references, relative to the hittables
+static constexpr float  s_sbvhOverlapAlpha = 1e-5f;     // overlap of object split children, relative to the root area,
+                                                        // that makes spatial splits worth trying
+static constexpr int    s_sbvhMaxDepth = 64;            // no spatial splits below, only object splits (which may go
+                                                        // deeper) finish the subtree
+
+static constexpr int    s_traversalStackSize = 256;     // a wide node pops one entry and pushes up to four,
+static constexpr int    s_maxTreeDepth = (s_traversalStackSize - 1) / 3;   // so this many levels always fit
+
+static constexpr int    s_treeletLeaves = 7;            // treelet restructuring, 2^7 subsets per treelet
+static constexpr int    s_treeletRounds = 3;
+
+static const char*      s_partitionNames[] = { "midpoint", "equal subset", "sah", "lbvh", "hlbvh", "sbvh", "ploc" };
+
+struct SMortonHittable
+{
+    uint64_t    code;
+    int         index;          // into the unsorted hittable info
+};
+
+//----------------------------------------------------
+
+static int  _ChunkCount(int nHittables)
+{
+    return std::max(1, (nHittables + s_chunkSize - 1) / s_chunkSize);
+}
+
+//----------------------------------------------------
+
+// call fn(chunk, first, last) for every chunk of [start, end), as pool tasks
+// when there is more than one chunk
+template <typename TFunc>
+static void _ForEachChunk(CThreadPool *pool, int start, int end, const TFunc &fn)
+{
+    const int   nChunks = _ChunkCount(end - start);
+    auto        runChunk = [&](int chunk) {
+        fn(chunk, start + chunk * s_chunkSize, std::min(end, start + (chunk + 1) * s_chunkSize));
+    };
+
+    if (pool == nullptr || nChunks == 1)
+    {
+        for (int chunk = 0; chunk < nChunks; chunk++)
+            runChunk(chunk);
+        return;
+    }
+
+    CTaskGroup  group(*pool);
+    for (int chunk = 1; chunk < nChunks; chunk++)
+        group.Run([&runChunk, chunk] { runChunk(chunk); });
+    runChunk(0);
+    group.Wait();
+}
+
+//----------------------------------------------------
+
+// LSD radix sort of "items" by the lower "nBits" of their code, "scratch"
+// holds n items and "histograms" one digit histogram per chunk. Chunks scatter
+// in order, so the sort is stable and independent of the thread count.
+static void _RadixSort(CThreadPool *pool, SMortonHittable *items, SMortonHittable *scratch, int n, int nBits, int *histograms)
+{
+    constexpr int   nDigits = 1 << s_radixBits;
+    const int       nChunks = _ChunkCount(n);
+
+    for (int shift = 0; shift < nBits; shift += s_radixBits)
+    {
+        _ForEachChunk(pool, 0, n, [&](int chunk, int first, int last) {
+            int     *histogram = &histograms[chunk * nDigits];
+            std::fill_n(histogram, nDigits, 0);
+            for (int i = first; i < last; i++)
+                histogram[(items[i].code >> shift) & (nDigits - 1)]++;
+        });
+
+        // exclusive scan, digit major so every chunk writes after the
+        // same digit of all preceding chunks
+        int     offset = 0;
+        for (int digit = 0; digit < nDigits; digit++)
+        {
+            for (int chunk = 0; chunk < nChunks; chunk++)
+            {
+                int     count = histograms[chunk * nDigits + digit];
+                histograms[chunk * nDigits + digit] = offset;
+                offset += count;
+            }
+        }
+
+        _ForEachChunk(pool, 0, n, [&](int chunk, int first, int last) {
+            int     *histogram = &histograms[chunk * nDigits];
+            for (int i = first; i < last; i++)
+                scratch[histogram[(items[i].code >> shift) & (nDigits - 1)]++] = items[i];
+        });
+
+        std::swap(items, scratch);
+    }
+
+    // an odd number of passes ends in the caller's scratch, copy it back
+    if (((nBits + s_radixBits - 1) / s_radixBits) % 2 == 1)
+        std::copy(items, items + n, scratch);
+}
+
+//----------------------------------------------------
+
 CBVHAccel::CBVHAccel()
 {
 }
 
 //----------------------------------------------------
 
-CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType)
+CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType,
+                     CThreadPool *pool, bool restructure)
 : m_hittables(hittables)
 , m_maxHittablesInNode(std::min(255, maxHittablesInNode))
 , m_partitionMethod(partitionType)
+, m_restructure(restructure)
+{
+    _BuildTree(pool);
+}
+
+//----------------------------------------------------
+
+CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const u_int32_t *hittableOrder, int maxHittablesInNode,
+                     EPartitionType partitionType, bool restructure, void *nodes, int nNodes, float sahCost,
+                     const std::shared_ptr<void> &nodeStorage)
+: m_maxHittablesInNode(std::min(255, maxHittablesInNode))
+, m_partitionMethod(partitionType)
+, m_restructure(restructure)
+, m_hittables(hittables)
+, m_nodes((SLinearBVHNode*)nodes)
+, m_nodeStorage(nodeStorage)
+, m_hittableOrder(hittableOrder, hittableOrder + hittables.size())
+, m_totalNodes(nNodes)
+, m_buildSAHCost(sahCost)
 {
-    _BuildTree();
+    for (const auto &hittable : m_hittables)
+        m_hittablePtrs.push_back(hittable.get());
+
+    _PackPrimitives();
+
+    m_wideNodes.reserve(m_totalNodes / 2 + 1);
+    _CollapseWide(0);
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::IsValidTree(const void *nodes, int nNodes, int nHittables)
+{
+    const SLinearBVHNode    *linearNodes = (const SLinearBVHNode*)nodes;
+
+    // walk the tree like a depth-first flatten, every node has to be the
+    // next one in the array
+    struct SExpectedNode
+    {
+        int     offset;
+        int     depth;
+    };
+    std::vector<SExpectedNode>  toVisit = { { 0, 0 } };
+    int                         next = 0;
+    while (!toVisit.empty())
+    {
+        const SExpectedNode     expected = toVisit.back();
+        toVisit.pop_back();
+        if (expected.offset != next || next >= nNodes || expected.depth > s_maxTreeDepth)
+            return false;
+
+        const SLinearBVHNode    &node = linearNodes[next++];
+        if (node.nHittables > 0)
+        {
+            if (node.hittablesOffset < 0 || node.hittablesOffset > nHittables - node.nHittables)
+                return false;
+            continue;
+        }
+
+        if (node.axis > 2 || node.secondChildOffset <= next)
+            return false;
+        toVisit.push_back({ node.secondChildOffset, expected.depth + 1 });
+        toVisit.push_back({ next, expected.depth + 1 });
+    }
+
+    return next == nNodes;
 }
 
 //----------------------------------------------------
 
 CBVHAccel::~CBVHAccel()
 {
-    // delete[] m_nodes;    Why not working?
+    _FreeReplicas();
+    _FreeNodes();
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_FreeNodes()
+{
+    if (m_nodeStorage == nullptr)
+        delete[] m_nodes;
+    m_nodeStorage.reset();
+    m_nodes = nullptr;
 }
 
 //----------------------------------------------------
 
 bool CBVHAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
 {
+    if (m_isCompressed)
+        return _Traverse<false>(m_quantizedNodes.data(), &SNumaReplica::quantizedNodes, ray, t_min, t_max, &hitRec);
+    return _Traverse<false>(m_wideNodes.data(), &SNumaReplica::wideNodes, ray, t_min, t_max, &hitRec);
+}
+
+//----------------------------------------------------
+
+bool CBVHAccel::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    if (m_isCompressed)
+        return _Traverse<true>(m_quantizedNodes.data(), &SNumaReplica::quantizedNodes, ray, t_min, t_max, nullptr);
+    return _Traverse<true>(m_wideNodes.data(), &SNumaReplica::wideNodes, ray, t_min, t_max, nullptr);
+}
+
+//----------------------------------------------------
+
+// closest hit into "hitRec", or with "anyHit" stop at the first intersection
+template <bool anyHit, typename TNode>
+bool CBVHAccel::_Traverse(const TNode *nodes, TNode *SNumaReplica::*replicaNodes,
+                          const CRay &ray, float t_min, float t_max, SHitRec *hitRec) const
+{
+    if (IsEmpty())
+        return false;
+
     SHitRec     hitTmp;
     bool        isHit = false;
     float       tClosest = t_max;
 
-    // follow ray through BVH nodes to find primitive intersections
-    int     toVisitOffset = 0;
-    int     currentNodeIndex = 0;
-    int     nodesToVisit[64];
+    // prefer the copy on the NUMA node of the calling worker
+    const IHittable *const  *hittables = m_hittablePtrs.data();
+    const SPackedTriangle   *triangles = m_packedTriangles.data();
+    const SPackedSphere     *spheres = m_packedSpheres.data();
+    const SPackedOffsets    *packedOffsets = m_packedOffsets.data();
+    const int               numaNode = CCpuTopology::GetCurrentNode();
+    if (numaNode < (int)m_replicas.size())
+    {
+        const SNumaReplica  &replica = m_replicas[numaNode];
+        nodes = replica.*replicaNodes;
+        hittables = replica.hittables;
+        triangles = replica.triangles;
+        spheres = replica.spheres;
+        packedOffsets = replica.packedOffsets;
+    }
+
+    // packed primitives only record the closest hit, its hittable fills
+    // "hitRec" once the traversal is done
+    enum EClosest { NONE, TRIANGLE, SPHERE, OTHER };
+    EClosest    closest = NONE;
+    int         closestSlot = 0;
+    float       t;
+
+    // the octant picks near and far planes per axis, so no per-node swaps
+    const STraversalRay     tray(ray);
+    const int               nearX = tray.octant[0], farX = 1 - nearX;
+    const int               nearY = tray.octant[1], farY = 1 - nearY;
+    const int               nearZ = tray.octant[2], farZ = 1 - nearZ;
+#if defined(__SSE__)
+    const __m128    orgX = _mm_set1_ps(tray.origin.x), invX = _mm_set1_ps(tray.invDir.x);
+    const __m128    orgY = _mm_set1_ps(tray.origin.y), invY = _mm_set1_ps(tray.invDir.y);
+    const __m128    orgZ = _mm_set1_ps(tray.origin.z), invZ = _mm_set1_ps(tray.invDir.z);
+#endif
+
+    // stack entries are wide nodes or leaves (nHittables > 0), each wide
+    // node pushes at most 4 entries for one it pops. "tEntry" is where the
+    // ray enters the box, entries beyond the closest hit so far are dropped.
+    struct SStackEntry
+    {
+        int32_t     index;
+        uint16_t    nHittables;
+        float       tEntry;
+    };
+    SStackEntry     toVisit[s_traversalStackSize];
+    int             toVisitOffset = 0;
+    toVisit[toVisitOffset++] = { 0, 0, t_min };
 
-    while (true) {
-        const SLinearBVHNode    *node = &m_nodes[currentNodeIndex];
+    while (toVisitOffset > 0)
+    {
+        const SStackEntry   entry = toVisit[--toVisitOffset];
+        if (entry.tEntry > tClosest)
+            continue;
 
-        // check ray against BVH node
-        if (node->bounds.Hit(ray)) {
-            if (node->nHittables > 0)
+        if (entry.nHittables > 0)
+        {
+            // intersect ray with primitives in leaf BVH node: the packed
+            // triangles, the packed spheres, then the other hittables
+            const SPackedOffsets    &first = packedOffsets[entry.index];
+            const SPackedOffsets    &last = packedOffsets[entry.index + entry.nHittables];
+            for (int i = first.triangles; i < last.triangles; i++)
             {
-                // intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nHittables; i++) {
-                    if (m_hittables[node->hittablesOffset + i]->Hit(ray, t_min, tClosest, hitTmp))
-                    {
-                        hitRec = hitTmp;
-                        tClosest = hitTmp.t;
-                        isHit = true;
-                    }
+                const SPackedTriangle   &triangle = triangles[i];
+                if (CHittableTriangle::Intersect(triangle.v0, triangle.edge1, triangle.edge2, ray, t_min, tClosest, t))
+                {
+                    if (anyHit)
+                        return true;
+
+                    tClosest = t;
+                    closest = TRIANGLE;
+                    closestSlot = entry.index + (i - first.triangles);
+                    isHit = true;
                 }
-                if (toVisitOffset == 0)
-                    break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
             }
-            else 
+
+            const int   sphereSlot = entry.index + (last.triangles - first.triangles);
+            for (int i = first.spheres; i < last.spheres; i++)
             {
-                // put far BVH node on nodesToVisit stack, advance to near node
-                const glm::vec3 invDir = 1.f / ray.m_dir;
-                int             dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+                if (CHittableSphere::Intersect(spheres[i].origin, spheres[i].radius, ray, t_min, tClosest, t))
+                {
+                    if (anyHit)
+                        return true;
+
+                    tClosest = t;
+                    closest = SPHERE;
+                    closestSlot = sphereSlot + (i - first.spheres);
+                    isHit = true;
+                }
+            }
 
-                if (dirIsNeg[node->axis])
+            for (int i = sphereSlot + (last.spheres - first.spheres); i < entry.index + entry.nHittables; i++) {
+                if (anyHit)
                 {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
+                    if (hittables[i]->Occluded(ray, t_min, tClosest))
+                        return true;
                 }
-                else
+                else if (hittables[i]->Hit(ray, t_min, tClosest, hitTmp))
                 {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    *hitRec = hitTmp;
+                    tClosest = hitTmp.t;
+                    closest = OTHER;
+                    isHit = true;
                 }
             }
+            continue;
         }
-        else {
-            if (toVisitOffset == 0)
-                break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+        // check ray against all child boxes at once
+        const TNode         &node = nodes[entry.index];
+        alignas(16) float   decoded[2][3][4];
+        const TBoundsSlice  *bounds = _DecodeBounds(node, decoded);
+        alignas(16) float   tNear[4];
+        int                 hitMask;
+#if defined(__SSE__)
+        {
+            // clipped to [t_min, tClosest]. The distance comes first in
+            // min/max, SSE then returns the running value if it is NaN (ray
+            // inside a slab plane)
+            __m128  tEnter = _mm_set1_ps(t_min);
+            __m128  tExit = _mm_set1_ps(tClosest);
+
+            tEnter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[nearX][0]), orgX), invX), tEnter);
+            tEnter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[nearY][1]), orgY), invY), tEnter);
+            tEnter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[nearZ][2]), orgZ), invZ), tEnter);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[farX][0]), orgX), invX), tExit);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[farY][1]), orgY), invY), tExit);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[farZ][2]), orgZ), invZ), tExit);
+
+            _mm_store_ps(tNear, tEnter);
+            hitMask = _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+        }
+#else
+        // the octant selects whole rows once per node, the child loop then
+        // reads fixed rows like the SSE path and may be vectorized
+        const float     *nearXs = bounds[nearX][0], *farXs = bounds[farX][0];
+        const float     *nearYs = bounds[nearY][1], *farYs = bounds[farY][1];
+        const float     *nearZs = bounds[nearZ][2], *farZs = bounds[farZ][2];
+        hitMask = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            float   tEnter = t_min;
+            float   tExit = tClosest;
+            tEnter = std::max(tEnter, (nearXs[c] - tray.origin.x) * tray.invDir.x);
+            tEnter = std::max(tEnter, (nearYs[c] - tray.origin.y) * tray.invDir.y);
+            tEnter = std::max(tEnter, (nearZs[c] - tray.origin.z) * tray.invDir.z);
+            tExit = std::min(tExit, (farXs[c] - tray.origin.x) * tray.invDir.x);
+            tExit = std::min(tExit, (farYs[c] - tray.origin.y) * tray.invDir.y);
+            tExit = std::min(tExit, (farZs[c] - tray.origin.z) * tray.invDir.z);
+            tNear[c] = tEnter;
+            hitMask |= (tEnter <= tExit) << c;
+        }
+#endif
+        hitMask &= (1 << node.nChildren) - 1;
+
+        // push hit children farthest first, so the nearest is visited next
+        int     order[4];
+        int     nHit = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            if (!(hitMask & (1 << c)))
+                continue;
+
+            int     i = nHit++;
+            for (; i > 0 && tNear[order[i - 1]] < tNear[c]; i--)
+                order[i] = order[i - 1];
+            order[i] = c;
         }
+
+        for (int i = 0; i < nHit; i++)
+            toVisit[toVisitOffset++] = { node.children[order[i]], node.nHittables[order[i]], tNear[order[i]] };
     }
 
+    if (closest == TRIANGLE)
+        static_cast<const CHittableTriangle*>(hittables[closestSlot])->SetHitRec(ray, tClosest, *hitRec);
+    else if (closest == SPHERE)
+        static_cast<const CHittableSphere*>(hittables[closestSlot])->SetHitRec(ray, tClosest, *hitRec);
+
     return isHit;
 }
 
@@ -90,224 +443,1769 @@ bool CBVHAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec)
 
 void    CBVHAccel::Clear()
 {
+    _FreeReplicas();
     m_hittables.clear();
-    delete[] m_nodes;
+    m_hittablePtrs.clear();
+    m_wideNodes.clear();
+    m_quantizedNodes.clear();
+    m_wideChildNodes.clear();
+    m_hittableOrder.clear();
+    m_packedTriangles.clear();
+    m_packedSpheres.clear();
+    m_packedOffsets.clear();
+    _FreeNodes();
+    m_totalNodes = 0;
+    m_buildSAHCost = 0.f;
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::Refit(CThreadPool *pool, float maxCostGrowth)
+{
+    if (IsEmpty())
+        return false;
+
+    // 0. hittables whose bounds derive from other objects (instances). An
+    // SBVH tree may list one several times, so this stays serial.
+    for (const auto &hittable : m_hittables)
+        hittable->UpdateBounds();
+
+    // 1. leaves, from the current hittable bounds. SBVH leaves lose their
+    // clipped bounds and get the whole hittable, which stays conservative.
+    _ForEachChunk(pool, 0, m_totalNodes, [&](int, int first, int last) {
+        for (int i = first; i < last; i++)
+        {
+            SLinearBVHNode  &node = m_nodes[i];
+            if (node.nHittables == 0)
+                continue;
+
+            CAABB   bounds;
+            for (int k = 0; k < node.nHittables; k++)
+            {
+                bounds = bounds + m_hittablePtrs[node.hittablesOffset + k]->m_aabb;
+                _PackPrimitive(node.hittablesOffset + k);
+            }
+            node.bounds = bounds;
+        }
+    });
+
+    // 2. interior nodes, children follow their parent in depth-first order
+    // so a reverse sweep sees them first. The SAH cost comes along.
+    float   cost = 0.f;
+    for (int i = m_totalNodes - 1; i >= 0; i--)
+    {
+        SLinearBVHNode  &node = m_nodes[i];
+        if (node.nHittables == 0)
+            node.bounds = m_nodes[i + 1].bounds + m_nodes[node.secondChildOffset].bounds;
+
+        cost += (node.nHittables > 0 ? node.nHittables : 1) * node.bounds.SurfaceArea();
+    }
+    cost /= m_nodes[0].bounds.SurfaceArea();
+
+    if (cost > maxCostGrowth * m_buildSAHCost)
+    {
+        printf("[BVH] SAH cost grew from %.2f to %.2f since the build, rebuilding\n", m_buildSAHCost, cost);
+
+        // SBVH leaves may repeat a hittable, keep each one once
+        std::vector<std::shared_ptr<IHittable>>     hittables;
+        std::vector<u_int32_t>                      order;
+        std::unordered_set<const IHittable*>        seen;
+        for (size_t i = 0; i < m_hittables.size(); i++)
+        {
+            if (seen.insert(m_hittables[i].get()).second)
+            {
+                hittables.push_back(m_hittables[i]);
+                order.push_back(m_hittableOrder[i]);
+            }
+        }
+
+        const u_int32_t     nReplicas = m_replicas.size();
+        Clear();
+        m_hittables.swap(hittables);
+        _BuildTree(pool);
+
+        // the new order indexes the list it was built from
+        for (u_int32_t &index : m_hittableOrder)
+            index = order[index];
+        if (nReplicas > 0)
+            ReplicateNuma(nReplicas);
+        return true;
+    }
+
+    // empty packed arrays have no replica
+    for (SNumaReplica &replica : m_replicas)
+    {
+        if (replica.triangles != nullptr)
+            memcpy(replica.triangles, m_packedTriangles.data(), m_packedTriangles.size() * sizeof(SPackedTriangle));
+        if (replica.spheres != nullptr)
+            memcpy(replica.spheres, m_packedSpheres.data(), m_packedSpheres.size() * sizeof(SPackedSphere));
+    }
+
+    // 3. wide nodes keep their topology, copy the bounds they were made of
+    if (m_isCompressed)
+    {
+        _ForEachChunk(pool, 0, m_quantizedNodes.size(), [&](int, int first, int last) {
+            for (int i = first; i < last; i++)
+            {
+                SQuantizedBVHNode   &quantizedNode = m_quantizedNodes[i];
+                CAABB               childBounds[4];
+                for (int c = 0; c < quantizedNode.nChildren; c++)
+                    childBounds[c] = m_nodes[m_wideChildNodes[4 * i + c]].bounds;
+                _QuantizeBounds(quantizedNode, childBounds, quantizedNode.nChildren);
+            }
+        });
+
+        for (SNumaReplica &replica : m_replicas)
+            memcpy(replica.quantizedNodes, m_quantizedNodes.data(), m_quantizedNodes.size() * sizeof(SQuantizedBVHNode));
+        return false;
+    }
+
+    _ForEachChunk(pool, 0, m_wideNodes.size(), [&](int, int first, int last) {
+        for (int i = first; i < last; i++)
+        {
+            SWideBVHNode    &wideNode = m_wideNodes[i];
+            for (int c = 0; c < wideNode.nChildren; c++)
+            {
+                const CAABB     &bounds = m_nodes[m_wideChildNodes[4 * i + c]].bounds;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    wideNode.bounds[0][axis][c] = bounds.pMin[axis];
+                    wideNode.bounds[1][axis][c] = bounds.pMax[axis];
+                }
+            }
+        }
+    });
+
+    for (SNumaReplica &replica : m_replicas)
+        memcpy(replica.wideNodes, m_wideNodes.data(), m_wideNodes.size() * sizeof(SWideBVHNode));
+
+    return false;
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::ReplicateNuma(u_int32_t nNodes)
+{
+    // instanced trees are reached once per instance, copy them once
+    if (IsEmpty() || m_replicas.size() == nNodes)
+        return;
+
+    _FreeReplicas();
+
+    // empty arrays (e.g. no spheres) have no copy
+    bool    isAllocated = true;
+    auto    copyToNode = [&isAllocated](const void *data, size_t bytes, u_int32_t node) -> void* {
+        if (bytes == 0 || !isAllocated)
+            return nullptr;
+
+        void    *copy = CCpuTopology::AllocOnNode(bytes, node);
+        if (copy == nullptr)
+        {
+            isAllocated = false;
+            return nullptr;
+        }
+        memcpy(copy, data, bytes);
+        return copy;
+    };
+
+    m_replicas.resize(nNodes);
+    for (u_int32_t node = 0; node < nNodes; node++)
+    {
+        SNumaReplica    &replica = m_replicas[node];
+        if (m_isCompressed)
+            replica.quantizedNodes = (SQuantizedBVHNode*)copyToNode(m_quantizedNodes.data(), m_quantizedNodes.size() * sizeof(SQuantizedBVHNode), node);
+        else
+            replica.wideNodes = (SWideBVHNode*)copyToNode(m_wideNodes.data(), m_wideNodes.size() * sizeof(SWideBVHNode), node);
+        replica.hittables = (const IHittable**)copyToNode(m_hittablePtrs.data(), m_hittablePtrs.size() * sizeof(const IHittable*), node);
+        replica.triangles = (SPackedTriangle*)copyToNode(m_packedTriangles.data(), m_packedTriangles.size() * sizeof(SPackedTriangle), node);
+        replica.spheres = (SPackedSphere*)copyToNode(m_packedSpheres.data(), m_packedSpheres.size() * sizeof(SPackedSphere), node);
+        replica.packedOffsets = (SPackedOffsets*)copyToNode(m_packedOffsets.data(), m_packedOffsets.size() * sizeof(SPackedOffsets), node);
+    }
+
+    // traversal falls back to the shared data without replicas
+    if (!isAllocated)
+    {
+        printf("[BVH] Warn: Out of memory for NUMA replicas, all nodes share one copy\n");
+        _FreeReplicas();
+    }
+
+    // nested acceleration structures (e.g. meshes) replicate their own data
+    for (const auto &hittable : m_hittables)
+        hittable->ReplicateNuma(nNodes);
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_FreeReplicas()
+{
+    for (SNumaReplica &replica : m_replicas)
+    {
+        if (replica.quantizedNodes != nullptr)
+            CCpuTopology::FreeOnNode(replica.quantizedNodes, m_quantizedNodes.size() * sizeof(SQuantizedBVHNode));
+        else
+            CCpuTopology::FreeOnNode(replica.wideNodes, m_wideNodes.size() * sizeof(SWideBVHNode));
+        CCpuTopology::FreeOnNode(replica.hittables, m_hittablePtrs.size() * sizeof(const IHittable*));
+        CCpuTopology::FreeOnNode(replica.triangles, m_packedTriangles.size() * sizeof(SPackedTriangle));
+        CCpuTopology::FreeOnNode(replica.spheres, m_packedSpheres.size() * sizeof(SPackedSphere));
+        CCpuTopology::FreeOnNode(replica.packedOffsets, m_packedOffsets.size() * sizeof(SPackedOffsets));
+    }
+    m_replicas.clear();
+}
+
+//----------------------------------------------------
+
+// Group every leaf range by type, triangles first and then spheres, and copy
+// those two into the packed arrays in the same order
+void    CBVHAccel::_PackPrimitives()
+{
+    enum EKind : uint8_t { TRIANGLE, SPHERE, OTHER };
+
+    const int               nSlots = m_hittablePtrs.size();
+    std::vector<uint8_t>    kinds(nSlots);
+    for (int i = 0; i < nSlots; i++)
+    {
+        if (dynamic_cast<const CHittableTriangle*>(m_hittablePtrs[i]) != nullptr)
+            kinds[i] = TRIANGLE;
+        else if (dynamic_cast<const CHittableSphere*>(m_hittablePtrs[i]) != nullptr)
+            kinds[i] = SPHERE;
+        else
+            kinds[i] = OTHER;
+    }
+
+    // stable, so grouped leaves (e.g. from a cache) keep their order
+    std::vector<int>                            slots;
+    std::vector<std::shared_ptr<IHittable>>     hittables;
+    std::vector<u_int32_t>                      order;
+    for (int n = 0; n < m_totalNodes; n++)
+    {
+        const SLinearBVHNode    &node = m_nodes[n];
+        const int               first = node.hittablesOffset;
+        if (node.nHittables == 0 || std::is_sorted(&kinds[first], &kinds[first] + node.nHittables))
+            continue;
+
+        slots.resize(node.nHittables);
+        for (int i = 0; i < node.nHittables; i++)
+            slots[i] = first + i;
+        std::stable_sort(slots.begin(), slots.end(), [&kinds](int a, int b) { return kinds[a] < kinds[b]; });
+
+        hittables.resize(node.nHittables);
+        order.resize(node.nHittables);
+        for (int i = 0; i < node.nHittables; i++)
+        {
+            hittables[i] = m_hittables[slots[i]];
+            order[i] = m_hittableOrder[slots[i]];
+        }
+        for (int i = 0; i < node.nHittables; i++)
+        {
+            m_hittables[first + i] = hittables[i];
+            m_hittablePtrs[first + i] = hittables[i].get();
+            m_hittableOrder[first + i] = order[i];
+        }
+        std::sort(&kinds[first], &kinds[first] + node.nHittables);
+    }
+
+    SPackedOffsets  offsets = { 0, 0 };
+    m_packedOffsets.resize(nSlots + 1);
+    for (int i = 0; i < nSlots; i++)
+    {
+        m_packedOffsets[i] = offsets;
+        offsets.triangles += kinds[i] == TRIANGLE;
+        offsets.spheres += kinds[i] == SPHERE;
+    }
+    m_packedOffsets[nSlots] = offsets;
+
+    m_packedTriangles.resize(offsets.triangles);
+    m_packedSpheres.resize(offsets.spheres);
+    for (int i = 0; i < nSlots; i++)
+        _PackPrimitive(i);
 }
 
 //----------------------------------------------------
 
-bool   CBVHAccel:: _BuildTree()
+// copy the geometry of the hittable in "slot", if it is packed
+void    CBVHAccel::_PackPrimitive(int slot)
+{
+    const SPackedOffsets    &offsets = m_packedOffsets[slot];
+    const SPackedOffsets    &next = m_packedOffsets[slot + 1];
+    if (next.triangles > offsets.triangles)
+    {
+        const CHittableTriangle     *triangle = static_cast<const CHittableTriangle*>(m_hittablePtrs[slot]);
+        m_packedTriangles[offsets.triangles] = { triangle->m_v0, triangle->m_v1 - triangle->m_v0, triangle->m_v2 - triangle->m_v0 };
+    }
+    else if (next.spheres > offsets.spheres)
+    {
+        const CHittableSphere       *sphere = static_cast<const CHittableSphere*>(m_hittablePtrs[slot]);
+        m_packedSpheres[offsets.spheres] = { sphere->m_origin, sphere->m_radius };
+    }
+}
+
+//----------------------------------------------------
+
+bool   CBVHAccel:: _BuildTree(CThreadPool *pool)
 {
     if (m_hittables.size() == 0)
         return true;
 
     // BVH-Tree construction
     printf("[BVH] Start bvh-tree construction...\n");
+    auto    begin = std::chrono::steady_clock::now();
 
-    // 1. initialize primitive info
-    std::vector<SHittableInfo>     hittableInfo(m_hittables.size());
-    for (size_t i = 0; i < hittableInfo.size(); i++)
+    // one arena per thread that may run build tasks, the caller uses the first
+    m_buildPool = pool;
+    m_buildThread = std::this_thread::get_id();
+    m_buildArenas.resize(pool != nullptr ? pool->GetThreadCount() + 1 : 1);
+    for (auto &arena : m_buildArenas)
+        arena = std::make_unique<CMemoryArena>();
+
+    const int                   nHittables = m_hittables.size();
+    const EPartitionType        partitionMethod = m_partitionMethod;
+    std::vector<SHittableInfo>  hittableInfo;
+    std::atomic<int>            totalNodes(0);
+    while (true)
     {
-        hittableInfo[i] = { i, m_hittables[i]->m_aabb };
-    };
+        // 1. initialize primitive info
+        hittableInfo.resize(nHittables);
+        _ForEachChunk(pool, 0, nHittables, [&](int, int first, int last) {
+            for (int i = first; i < last; i++)
+                hittableInfo[i] = { (size_t)i, m_hittables[i]->m_aabb };
+        });
+
+        CAABB   bounds, centroidBounds;
+        _ComputeBounds(hittableInfo, 0, nHittables, bounds, centroidBounds, pool);
+
+        // 2. build BVH tree, leaves reference their range of "hittableInfo"
+        totalNodes = 0;
+        SBVHBuildNode   *root = nullptr;
+        if (m_partitionMethod == LBVH || m_partitionMethod == HLBVH || m_partitionMethod == PLOC)
+            root = _BuildLBVH(hittableInfo, centroidBounds, totalNodes, pool);
+        else if (m_partitionMethod == SBVH)
+        {
+            // leaves own their references, which may repeat a hittable
+            const int   refBudget = nHittables * s_sbvhMaxGrowth;
+            root = _RecursiveBuildSpatial(hittableInfo, bounds, centroidBounds, refBudget, 0, bounds.SurfaceArea(), totalNodes, pool);
+            hittableInfo.clear();
+            _GatherSpatialLeaves(root, hittableInfo);
+            printf("[BVH] %zu references to %d hittables (+%.1f%%)\n",
+                   hittableInfo.size(), nHittables, 100.f * (hittableInfo.size() - nHittables) / nHittables);
+        }
+        else
+            root = _RecursiveBuild(hittableInfo, 0, nHittables, bounds, centroidBounds, totalNodes, pool);
 
-    // 2. build BVH tree
-    int     totalNodes = 0;
-    std::vector<std::shared_ptr<IHittable>>     orderedHittables;
-    orderedHittables.reserve(m_hittables.size());
+        if (m_restructure)
+            _RestructureTreelets(root, pool);
 
-    SBVHBuildNode   *root = _RecursiveBuild(hittableInfo, 0, m_hittables.size(), &totalNodes, orderedHittables);
+        // 3. compute representation of depth-first traversal
+        m_totalNodes = totalNodes;
+        m_nodes = new SLinearBVHNode[m_totalNodes];
+        int offset = 0;
+        _FlattenBVHTree(root, &offset);
+
+        // Traversal has a fixed stack, so no builder may hand it a deeper
+        // tree (e.g. PLOC on nested spheres). SAH takes over, and equal
+        // subsets, whose depth is logarithmic, if SAH fails as well.
+        if (IsValidTree(m_nodes, m_totalNodes, hittableInfo.size()) || m_partitionMethod == EQUALSUBSET)
+            break;
+
+        const EPartitionType    fallback = m_partitionMethod == SAH ? EQUALSUBSET : SAH;
+        printf("[BVH] Warn: %s bvh-tree is deeper than the traversal stack, rebuilding with %s\n",
+               s_partitionNames[m_partitionMethod], s_partitionNames[fallback]);
+        delete[] m_nodes;
+        m_nodes = nullptr;
+        m_partitionMethod = fallback;
+    }
+    const EPartitionType    builtMethod = m_partitionMethod;
+    m_partitionMethod = partitionMethod;
+
+    std::vector<std::shared_ptr<IHittable>>     orderedHittables(hittableInfo.size());
+    m_hittableOrder.resize(hittableInfo.size());
+    for (size_t i = 0; i < hittableInfo.size(); i++)
+    {
+        orderedHittables[i] = m_hittables[hittableInfo[i].hittableNum];
+        m_hittableOrder[i] = hittableInfo[i].hittableNum;
+    }
     m_hittables.swap(orderedHittables);
     hittableInfo.resize(0);
-    
-    // 3. compute representation of depth-first traversal
-    m_nodes = new SLinearBVHNode[totalNodes];
-    int offset = 0;
-    _FlattenBVHTree(root, &offset);
+
+    m_hittablePtrs.clear();
+    for (const auto &hittable : m_hittables)
+        m_hittablePtrs.push_back(hittable.get());
+
+    // build nodes are not needed anymore
+    size_t  arenaBytes = 0;
+    for (const auto &arena : m_buildArenas)
+        arenaBytes += arena->GetTotalAllocated();
+    for (const auto &helper : m_helperArenas)
+        arenaBytes += helper.second->GetTotalAllocated();
+    m_buildArenas.clear();
+    m_helperArenas.clear();
+    m_buildPool = nullptr;
 
     if (this->IsEmpty())
     {
         printf("[BVH] Error: Failed to construct bvh-tree.\n");
         return false;
     }
-    
-    printf("[BVH] Done.\n");
+
+    _PackPrimitives();
+
+    // 4. collapse into the 4-wide traversal tree
+    m_wideNodes.clear();
+    m_wideNodes.reserve(m_totalNodes / 2 + 1);
+    m_wideChildNodes.clear();
+    _CollapseWide(0);
+    if (m_isCompressed)
+        _QuantizeWide();
+
+    m_buildSAHCost = ComputeSAHCost();
+
+    float   buildMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    printf("[BVH] Done. %d nodes (%zu wide) over %d hittables in %.2f ms (%s %s, %.1f MB build memory), SAH cost %.2f\n",
+           m_totalNodes, m_wideNodes.size(), nHittables, buildMs, pool != nullptr ? "parallel" : "serial", s_partitionNames[builtMethod],
+           arenaBytes / (1024.f * 1024.f), m_buildSAHCost);
     return true;
 }
 
 //----------------------------------------------------
 
-CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuild(std::vector<SHittableInfo> &bvHHittableInfo, int start, int end, int *totalNodes, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+void    CBVHAccel::_ComputeBounds(const std::vector<SHittableInfo> &hittableInfo, int start, int end, CAABB &bounds, CAABB &centroidBounds, CThreadPool *pool)
+{
+    // per-chunk partial bounds, only large ranges need arena scratch
+    const int   nChunks = _ChunkCount(end - start);
+    CAABB       localBounds[2];
+    CAABB       *chunkBounds = nChunks == 1 ? localBounds : _GetBuildArena().Alloc<CAABB>(2 * nChunks);
+    _ForEachChunk(pool, start, end, [&](int chunk, int first, int last) {
+        CAABB   b, cb;
+        for (int i = first; i < last; i++)
+        {
+            b = b + hittableInfo[i].bounds;
+            cb = cb + hittableInfo[i].centroid;
+        }
+        chunkBounds[2 * chunk + 0] = b;
+        chunkBounds[2 * chunk + 1] = cb;
+    });
+
+    bounds = centroidBounds = CAABB();
+    for (int chunk = 0; chunk < nChunks; chunk++)
+    {
+        bounds = bounds + chunkBounds[2 * chunk + 0];
+        centroidBounds = centroidBounds + chunkBounds[2 * chunk + 1];
+    }
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuild(std::vector<SHittableInfo> &bvHHittableInfo, int start, int end, const CAABB &topBound, const CAABB &centroidBounds,
+                                                       std::atomic<int> &totalNodes, CThreadPool *pool)
 {
     // create node
-    SBVHBuildNode   *node = new SBVHBuildNode();
-    (*totalNodes)++;
-    
-    // compute bounds for all hittables in BVH node
-    CAABB   topBound;
-    for (int i = start; i < end; i++) 
-        topBound = topBound + bvHHittableInfo[i].bounds;
-    
+    SBVHBuildNode   *node = _GetBuildArena().Alloc<SBVHBuildNode>();
+    totalNodes++;
+
     int nHittables = end - start;
 
     if (nHittables == 1)
     {
         // create leaf node
+        node->InitLeaf(start, nHittables, topBound);
+        return node;
+    }
 
-        int firstPrimOffset = orderedHittables.size();
-        for (int i = start; i < end; i++)
-        {
-            int hittableNum = bvHHittableInfo[i].hittableNum;
-            orderedHittables.push_back(m_hittables[hittableNum]);
-        }
-        node->InitLeaf(firstPrimOffset, nHittables, topBound);
+    // the split axis is chosen by axis with the largest extent
+    int dim = centroidBounds.MaxExtent();
 
+    // partition hittables into two sets and build children
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+    {
+        // create leaf node
+        node->InitLeaf(start, nHittables, topBound);
         return node;
     }
-    else
+
+    // child bounds, known up front only for SAH splits
+    bool    hasChildBounds = false;
+    CAABB   childBounds[2], childCentroidBounds[2];
+
+    // partition by method
+    switch (m_partitionMethod)
     {
-        // compute bound of hittable centroids, choose split dimension dim
-        // the split axis is chosen by axis with the largest extent
-        CAABB   centroidBounds;
-        for (int i = start; i < end; i++)
+        // partition hittables using midpoints
+    case MIDPOINT:
+    {
+        float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
+        SHittableInfo *midPtr =
+            std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, [dim, pmid](const SHittableInfo &pi) { return pi.centroid[dim] < pmid; });
+        mid = midPtr - &bvHHittableInfo[0];
+
+        // if there is too many overlapping boxes, it may fail to construct.
+        // in that case, we split using equally subset method.
+        if (mid != start && mid != end) break;
+    }
+    case EQUALSUBSET:
+    {
+        mid = (start + end) / 2;
+        std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
+            [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; }
+        );
+        break;
+    }
+    case SAH:
+    default:
+    {
+        if (nHittables <= 2)
+        {
+            // partition primitives into equally sized subsets
+            mid = (start + end) / 2;
+            std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
+                [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; });
+            break;
+        }
+
+        auto    bucketOf = [&](const glm::vec3 &centroid) {
+            int b = s_nBuckets * centroidBounds.Offset(centroid)[dim];
+            return std::min(b, s_nBuckets - 1);
+        };
+
+        // init. BucketInfo for SAH partition buckets, per chunk for large nodes
+        const int       nChunks = _ChunkCount(nHittables);
+        SBucketInfo     localBuckets[s_nBuckets];
+        SBucketInfo     *chunkBuckets = nChunks == 1 ? localBuckets : _GetBuildArena().Alloc<SBucketInfo>(nChunks * s_nBuckets);
+        _ForEachChunk(pool, start, end, [&](int chunk, int first, int last) {
+            SBucketInfo     *buckets = &chunkBuckets[chunk * s_nBuckets];
+            for (int i = first; i < last; i++)
+            {
+                SBucketInfo     &bucket = buckets[bucketOf(bvHHittableInfo[i].centroid)];
+                bucket.count++;
+                bucket.bounds = bucket.bounds + bvHHittableInfo[i].bounds;
+                bucket.centroidBounds = bucket.centroidBounds + bvHHittableInfo[i].centroid;
+            }
+        });
+
+        SBucketInfo     buckets[s_nBuckets];
+        for (int i = 0; i < nChunks * s_nBuckets; i++)
         {
-            centroidBounds = centroidBounds + bvHHittableInfo[i].centroid;
+            SBucketInfo     &bucket = buckets[i % s_nBuckets];
+            bucket.count += chunkBuckets[i].count;
+            bucket.bounds = bucket.bounds + chunkBuckets[i].bounds;
+            bucket.centroidBounds = bucket.centroidBounds + chunkBuckets[i].centroidBounds;
         }
-        int dim = centroidBounds.MaxExtent();
 
-        // partition hittables into two sets and build children
-        int mid = (start + end) / 2;
-        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
-            // create leaf node
-            int firstHittableOffset = orderedHittables.size();
-            for (int i = start; i < end; i++)
+        // Compute costs for splitting after each bucket, sweeping from the
+        // right first so every split is evaluated in constant time
+        float   areaAbove[s_nBuckets - 1];
+        int     countAbove[s_nBuckets - 1];
+        {
+            CAABB   b1;
+            int     count1 = 0;
+            for (int i = s_nBuckets - 1; i > 0; i--)
             {
-                int hittableNum = bvHHittableInfo[i].hittableNum;
-                orderedHittables.push_back(m_hittables[hittableNum]);
+                b1 = b1 + buckets[i].bounds;
+                count1 += buckets[i].count;
+                areaAbove[i - 1] = b1.SurfaceArea();
+                countAbove[i - 1] = count1;
             }
-            node->InitLeaf(firstHittableOffset, nHittables, topBound);
+        }
+
+        // Find bucket to split at that minimizes SAH metric
+        float   minCost = std::numeric_limits<float>::max();
+        int     minCostSplitBucket = 0;
+        {
+            CAABB   b0;
+            int     count0 = 0;
+            for (int i = 0; i < s_nBuckets - 1; i++)
+            {
+                b0 = b0 + buckets[i].bounds;
+                count0 += buckets[i].count;
+
+                float   cost = 1 + (count0 * b0.SurfaceArea() + countAbove[i] * areaAbove[i]) / topBound.SurfaceArea();
+                if (cost < minCost)
+                {
+                    minCost = cost;
+                    minCostSplitBucket = i;
+                }
+            }
+        }
+
+        // Either create leaf or split primitives at selected SAH bucket
+        float   leafCost = nHittables;
+        if (nHittables <= m_maxHittablesInNode && minCost >= leafCost)
+        {
+            // create leaf BVHBuild node
+            node->InitLeaf(start, nHittables, topBound);
             return node;
         }
-        else 
+
+        SHittableInfo *pmid = std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1,
+            [&](const SHittableInfo &pi) { return bucketOf(pi.centroid) <= minCostSplitBucket; });
+        mid = pmid - &bvHHittableInfo[0];
+
+        for (int i = 0; i < s_nBuckets; i++)
         {
-            // partition by method
-            switch (m_partitionMethod) 
+            const int   side = i <= minCostSplitBucket ? 0 : 1;
+            childBounds[side] = childBounds[side] + buckets[i].bounds;
+            childCentroidBounds[side] = childCentroidBounds[side] + buckets[i].centroidBounds;
+        }
+        hasChildBounds = true;
+        break;
+    }}
+
+    if (!hasChildBounds)
+    {
+        _ComputeBounds(bvHHittableInfo, start, mid, childBounds[0], childCentroidBounds[0], pool);
+        _ComputeBounds(bvHHittableInfo, mid, end, childBounds[1], childCentroidBounds[1], pool);
+    }
+
+    // build nodes, the children own disjoint ranges so large ones run as
+    // separate tasks
+    SBVHBuildNode   *children[2];
+    if (pool != nullptr && nHittables >= s_parallelSubtreeMin)
+    {
+        CTaskGroup  group(*pool);
+        group.Run([&] {
+            children[1] = _RecursiveBuild(bvHHittableInfo, mid, end, childBounds[1], childCentroidBounds[1], totalNodes, pool);
+        });
+        children[0] = _RecursiveBuild(bvHHittableInfo, start, mid, childBounds[0], childCentroidBounds[0], totalNodes, pool);
+        group.Wait();
+    }
+    else
+    {
+        children[0] = _RecursiveBuild(bvHHittableInfo, start, mid, childBounds[0], childCentroidBounds[0], totalNodes, nullptr);
+        children[1] = _RecursiveBuild(bvHHittableInfo, mid, end, childBounds[1], childCentroidBounds[1], totalNodes, nullptr);
+    }
+    node->InitInterior(dim, children[0], children[1]);
+
+    return node;
+};
+
+//----------------------------------------------------
+
+// SBVH (Stich et al. 2009), binned SAH over the reference centroids compared
+// against spatial splits that clip the references straddling the plane.
+// "refs" is consumed. "refBudget" is the number of references this subtree
+// may still duplicate, it is shared by the children in proportion to their
+// size so the tree does not depend on the task order.
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuildSpatial(std::vector<SHittableInfo> &refs, const CAABB &topBound, const CAABB &centroidBounds,
+                                                              int refBudget, int depth, float rootArea, std::atomic<int> &totalNodes, CThreadPool *pool)
+{
+    // create node
+    SBVHBuildNode   *node = _GetBuildArena().Alloc<SBVHBuildNode>();
+    totalNodes++;
+
+    const int   nRefs = refs.size();
+    auto        makeLeaf = [&]() {
+        size_t  *hittableNums = _GetBuildArena().Alloc<size_t>(nRefs);
+        for (int i = 0; i < nRefs; i++)
+            hittableNums[i] = refs[i].hittableNum;
+        node->InitLeaf(0, nRefs, topBound);
+        node->hittableNums = hittableNums;
+        return node;
+    };
+
+    if (nRefs == 1)
+        return makeLeaf();
+
+    const float     invArea = 1.f / topBound.SurfaceArea();
+
+    // 1. object split, same buckets as SAH
+    const int   dim = centroidBounds.MaxExtent();
+    float       objectCost = std::numeric_limits<float>::max();
+    int         objectSplitBucket = -1;
+    CAABB       objectBounds[2];
+
+    auto    bucketOf = [&](const glm::vec3 &centroid) {
+        int b = s_nBuckets * centroidBounds.Offset(centroid)[dim];
+        return std::min(b, s_nBuckets - 1);
+    };
+    auto    isEmpty = [](const CAABB &b) {
+        return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+    };
+
+    if (centroidBounds.pMax[dim] > centroidBounds.pMin[dim])
+    {
+        SBucketInfo     buckets[s_nBuckets];
+        for (const SHittableInfo &ref : refs)
+        {
+            SBucketInfo     &bucket = buckets[bucketOf(ref.centroid)];
+            bucket.count++;
+            bucket.bounds = bucket.bounds + ref.bounds;
+        }
+
+        float   areaAbove[s_nBuckets - 1];
+        CAABB   b1;
+        for (int i = s_nBuckets - 1; i > 0; i--)
+        {
+            b1 = b1 + buckets[i].bounds;
+            areaAbove[i - 1] = b1.SurfaceArea();
+        }
+
+        CAABB   b0;
+        int     count0 = 0;
+        for (int i = 0; i < s_nBuckets - 1; i++)
+        {
+            b0 = b0 + buckets[i].bounds;
+            count0 += buckets[i].count;
+
+            float   cost = 1 + (count0 * b0.SurfaceArea() + (nRefs - count0) * areaAbove[i]) * invArea;
+            if (cost < objectCost)
             {
-                // partition hittables using midpoints
-            case MIDPOINT:
+                objectCost = cost;
+                objectSplitBucket = i;
+            }
+        }
+
+        for (int i = 0; i < s_nBuckets; i++)
+        {
+            const int   side = i <= objectSplitBucket ? 0 : 1;
+            objectBounds[side] = objectBounds[side] + buckets[i].bounds;
+        }
+    }
+
+    // 2. spatial split, only tried where the object split children overlap
+    const int   spatialDim = topBound.MaxExtent();
+    const float binOrigin = topBound.pMin[spatialDim];
+    const float binWidth = (topBound.pMax[spatialDim] - binOrigin) / s_nSpatialBins;
+    float       spatialCost = std::numeric_limits<float>::max();
+    int         spatialSplitBin = -1;
+    CAABB       spatialBounds[2];
+    int         spatialCounts[2] = { 0, 0 };
+
+    auto    spatialBinOf = [&](float position) {
+        int b = (position - binOrigin) / binWidth;
+        return std::min(std::max(b, 0), s_nSpatialBins - 1);
+    };
+
+    bool    trySpatial = refBudget > 0 && depth < s_sbvhMaxDepth && binWidth > 0.f;
+    if (trySpatial && objectSplitBucket >= 0)
+    {
+        CAABB   overlap = objectBounds[0] - objectBounds[1];
+        trySpatial = !isEmpty(overlap) && overlap.SurfaceArea() > s_sbvhOverlapAlpha * rootArea;
+    }
+
+    if (trySpatial)
+    {
+        struct SSpatialBin
+        {
+            CAABB   bounds;
+            int     entries = 0;
+            int     exits = 0;
+        };
+        SSpatialBin     bins[s_nSpatialBins];
+
+        // clip every reference into the bins it spans. A bound on a bin
+        // border falls into the upper bin, the partition below compares
+        // the same bins so the counts match the actual split.
+        for (const SHittableInfo &ref : refs)
+        {
+            const int   firstBin = spatialBinOf(ref.bounds.pMin[spatialDim]);
+            const int   lastBin = spatialBinOf(ref.bounds.pMax[spatialDim]);
+            CAABB       rest = ref.bounds;
+            for (int b = firstBin; b < lastBin; b++)
             {
-                float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
-                SHittableInfo *midPtr =
-                    std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, [dim, pmid](const SHittableInfo &pi) { return pi.centroid[dim] < pmid; });
-                mid = midPtr - &bvHHittableInfo[0];
-
-                // if there is too many overlapping boxes, it may fail to construct.
-                // in that case, we split using equally subset method.
-                if (mid != start && mid != end) break;
+                CAABB   left, right;
+                m_hittables[ref.hittableNum]->SplitBounds(spatialDim, binOrigin + (b + 1) * binWidth, rest, left, right);
+                bins[b].bounds = bins[b].bounds + left;
+                rest = right;
             }
-            case EQUALSUBSET:
+            bins[lastBin].bounds = bins[lastBin].bounds + rest;
+            bins[firstBin].entries++;
+            bins[lastBin].exits++;
+        }
+
+        CAABB   boundsAbove[s_nSpatialBins - 1];
+        int     countAbove[s_nSpatialBins - 1];
+        CAABB   b1;
+        int     count1 = 0;
+        for (int i = s_nSpatialBins - 1; i > 0; i--)
+        {
+            b1 = b1 + bins[i].bounds;
+            count1 += bins[i].exits;
+            boundsAbove[i - 1] = b1;
+            countAbove[i - 1] = count1;
+        }
+
+        CAABB   b0;
+        int     count0 = 0;
+        for (int i = 0; i < s_nSpatialBins - 1; i++)
+        {
+            b0 = b0 + bins[i].bounds;
+            count0 += bins[i].entries;
+
+            // both sides must shrink, and the duplicates must fit the budget
+            if (count0 == 0 || countAbove[i] == 0 || count0 == nRefs || countAbove[i] == nRefs ||
+                count0 + countAbove[i] - nRefs > refBudget)
+                continue;
+
+            float   cost = 1 + (count0 * b0.SurfaceArea() + countAbove[i] * boundsAbove[i].SurfaceArea()) * invArea;
+            if (cost < spatialCost)
             {
-                mid = (start + end) / 2;
-                std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
-                    [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; }
-                );
-                break;
+                spatialCost = cost;
+                spatialSplitBin = i;
+                spatialBounds[0] = b0;
+                spatialBounds[1] = boundsAbove[i];
+                spatialCounts[0] = count0;
+                spatialCounts[1] = countAbove[i];
             }
-            case SAH:
-            default:
+        }
+    }
+
+    // Either create leaf or split at the cheaper candidate
+    const float     minCost = std::min(objectCost, spatialCost);
+    if (minCost == std::numeric_limits<float>::max() || (nRefs <= m_maxHittablesInNode && minCost >= nRefs))
+        return makeLeaf();
+
+    std::vector<SHittableInfo>  childRefs[2];
+    int                         axis = dim;
+    if (spatialCost < objectCost)
+    {
+        axis = spatialDim;
+        const float     position = binOrigin + (spatialSplitBin + 1) * binWidth;
+        CAABB           &leftBounds = spatialBounds[0];
+        CAABB           &rightBounds = spatialBounds[1];
+        int             nLeft = spatialCounts[0];
+        int             nRight = spatialCounts[1];
+
+        for (const SHittableInfo &ref : refs)
+        {
+            if (spatialBinOf(ref.bounds.pMax[axis]) <= spatialSplitBin)
+                childRefs[0].push_back(ref);
+            else if (spatialBinOf(ref.bounds.pMin[axis]) > spatialSplitBin)
+                childRefs[1].push_back(ref);
+            else
             {
-                if (nHittables <= 2)
+                // reference unsplitting, keep a straddling reference whole on
+                // one side when that is cheaper than duplicating it
+                float   splitCost = leftBounds.SurfaceArea() * nLeft + rightBounds.SurfaceArea() * nRight;
+                float   leftCost = (leftBounds + ref.bounds).SurfaceArea() * nLeft + rightBounds.SurfaceArea() * (nRight - 1);
+                float   rightCost = leftBounds.SurfaceArea() * (nLeft - 1) + (rightBounds + ref.bounds).SurfaceArea() * nRight;
+
+                if (leftCost < splitCost && leftCost <= rightCost)
+                {
+                    childRefs[0].push_back(ref);
+                    leftBounds = leftBounds + ref.bounds;
+                    nRight--;
+                }
+                else if (rightCost < splitCost)
                 {
-                    // partition primitives into equally sized subsets
-                    mid = (start + end) / 2;
-                    std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
-                        [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; });
+                    childRefs[1].push_back(ref);
+                    rightBounds = rightBounds + ref.bounds;
+                    nLeft--;
                 }
-                else 
+                else
                 {
-                    // allocate BucketInfo for SAH partition buckets
-                    constexpr int nBuckets = 12;
-                    SBucketInfo buckets[nBuckets];
+                    // clipping may round one side away, then it is not split
+                    CAABB   left, right;
+                    m_hittables[ref.hittableNum]->SplitBounds(axis, position, ref.bounds, left, right);
+                    if (!isEmpty(left))
+                        childRefs[0].push_back(SHittableInfo(ref.hittableNum, isEmpty(right) ? ref.bounds : left));
+                    if (!isEmpty(right))
+                        childRefs[1].push_back(SHittableInfo(ref.hittableNum, isEmpty(left) ? ref.bounds : right));
+                }
+            }
+        }
+
+        // unsplitting may have moved every reference to one side
+        if (childRefs[0].empty() || childRefs[1].empty())
+        {
+            if (objectSplitBucket < 0)
+                return makeLeaf();
+
+            childRefs[0].clear();
+            childRefs[1].clear();
+            axis = dim;
+            spatialCost = std::numeric_limits<float>::max();
+        }
+    }
+
+    if (spatialCost >= objectCost)
+    {
+        for (const SHittableInfo &ref : refs)
+            childRefs[bucketOf(ref.centroid) <= objectSplitBucket ? 0 : 1].push_back(ref);
+    }
+
+    // the parent's references are not needed anymore
+    const int   nDuplicates = childRefs[0].size() + childRefs[1].size() - nRefs;
+    std::vector<SHittableInfo>().swap(refs);
+
+    CAABB   childBounds[2], childCentroidBounds[2];
+    for (int side = 0; side < 2; side++)
+    {
+        for (const SHittableInfo &ref : childRefs[side])
+        {
+            childBounds[side] = childBounds[side] + ref.bounds;
+            childCentroidBounds[side] = childCentroidBounds[side] + ref.centroid;
+        }
+    }
+
+    const int   remainingBudget = refBudget - nDuplicates;
+    int         childBudget[2];
+    childBudget[0] = (int64_t)remainingBudget * childRefs[0].size() / (childRefs[0].size() + childRefs[1].size());
+    childBudget[1] = remainingBudget - childBudget[0];
+
+    // build nodes, large children run as separate tasks
+    SBVHBuildNode   *children[2];
+    if (pool != nullptr && nRefs >= s_parallelSubtreeMin)
+    {
+        CTaskGroup  group(*pool);
+        group.Run([&] {
+            children[1] = _RecursiveBuildSpatial(childRefs[1], childBounds[1], childCentroidBounds[1], childBudget[1], depth + 1, rootArea, totalNodes, pool);
+        });
+        children[0] = _RecursiveBuildSpatial(childRefs[0], childBounds[0], childCentroidBounds[0], childBudget[0], depth + 1, rootArea, totalNodes, pool);
+        group.Wait();
+    }
+    else
+    {
+        children[0] = _RecursiveBuildSpatial(childRefs[0], childBounds[0], childCentroidBounds[0], childBudget[0], depth + 1, rootArea, totalNodes, nullptr);
+        children[1] = _RecursiveBuildSpatial(childRefs[1], childBounds[1], childCentroidBounds[1], childBudget[1], depth + 1, rootArea, totalNodes, nullptr);
+    }
+    node->InitInterior(axis, children[0], children[1]);
+
+    return node;
+}
+
+//----------------------------------------------------
+
+// give the SBVH leaves their range of "hittableInfo", in depth-first order
+void    CBVHAccel::_GatherSpatialLeaves(SBVHBuildNode *node, std::vector<SHittableInfo> &hittableInfo)
+{
+    if (node->nHittables == 0)
+    {
+        _GatherSpatialLeaves(node->children[0], hittableInfo);
+        _GatherSpatialLeaves(node->children[1], hittableInfo);
+        return;
+    }
+
+    node->firstHittableOffset = hittableInfo.size();
+    for (int i = 0; i < node->nHittables; i++)
+    {
+        SHittableInfo   info;
+        info.hittableNum = node->hittableNums[i];
+        hittableInfo.push_back(info);
+    }
+}
+
+//----------------------------------------------------
+
+// Sort the hittables along a morton curve over the centroid bounds and build
+// the tree from the sorted codes. Reorders "hittableInfo" to the code order.
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_BuildLBVH(std::vector<SHittableInfo> &hittableInfo, const CAABB &centroidBounds,
+                                                  std::atomic<int> &totalNodes, CThreadPool *pool)
+{
+    // 10 bits per axis keep the sort at 4 passes, large meshes need 21
+    const int   nHittables = hittableInfo.size();
+    const bool  isWideCode = nHittables > (1 << 20);
+    const int   nBits = isWideCode ? 63 : 30;
+
+    CMemoryArena        &arena = _GetBuildArena();
+    SMortonHittable     *morton = arena.Alloc<SMortonHittable>(nHittables);
+    SMortonHittable     *scratch = arena.Alloc<SMortonHittable>(nHittables);
+    int                 *histograms = arena.Alloc<int>(_ChunkCount(nHittables) << s_radixBits);
+
+    // 1. morton codes of the centroids
+    _ForEachChunk(pool, 0, nHittables, [&](int, int first, int last) {
+        const float     scale = isWideCode ? (float)(1 << 21) : (float)(1 << 10);
+        const uint32_t  maxCoord = isWideCode ? (1 << 21) - 1 : (1 << 10) - 1;
+        for (int i = first; i < last; i++)
+        {
+            glm::vec3   o = centroidBounds.Offset(hittableInfo[i].centroid);
+            uint32_t    x = std::min((uint32_t)(o.x * scale), maxCoord);
+            uint32_t    y = std::min((uint32_t)(o.y * scale), maxCoord);
+            uint32_t    z = std::min((uint32_t)(o.z * scale), maxCoord);
+
+            morton[i].code = isWideCode ? MortonEncode3D((uint64_t)x, (uint64_t)y, (uint64_t)z) : MortonEncode3D(x, y, z);
+            morton[i].index = i;
+        }
+    });
+
+    // 2. sort, then put the hittable info and codes in the same order
+    _RadixSort(pool, morton, scratch, nHittables, nBits, histograms);
+
+    std::vector<SHittableInfo>  sortedInfo(nHittables);
+    uint64_t                    *codes = arena.Alloc<uint64_t>(nHittables);
+    _ForEachChunk(pool, 0, nHittables, [&](int, int first, int last) {
+        for (int i = first; i < last; i++)
+        {
+            sortedInfo[i] = hittableInfo[morton[i].index];
+            codes[i] = morton[i].code;
+        }
+    });
+    hittableInfo.swap(sortedInfo);
+
+    if (m_partitionMethod == LBVH)
+        return _EmitLBVH(hittableInfo, codes, 0, nHittables, totalNodes, pool);
+    if (m_partitionMethod == PLOC)
+        return _BuildPLOC(hittableInfo, totalNodes, pool);
 
-                    // init. BucketInfo for SAH partition buckets
-                    for (int i = start; i < end; i++)
+    // 3. HLBVH: one treelet per run of equal top bits, joined by SAH
+    const int                   treeletShift = nBits - s_hlbvhTreeletBits;
+    std::vector<int>            treeletStarts;
+    for (int i = 0; i < nHittables; i++)
+    {
+        if (i == 0 || (codes[i] >> treeletShift) != (codes[i - 1] >> treeletShift))
+            treeletStarts.push_back(i);
+    }
+    treeletStarts.push_back(nHittables);
+
+    const int                   nTreelets = treeletStarts.size() - 1;
+    std::vector<SBVHBuildNode*> treelets(nTreelets);
+    auto    emitTreelet = [&](int t) {
+        treelets[t] = _EmitLBVH(hittableInfo, codes, treeletStarts[t], treeletStarts[t + 1], totalNodes, nullptr);
+    };
+
+    if (pool != nullptr)
+    {
+        CTaskGroup  group(*pool);
+        for (int t = 0; t < nTreelets; t++)
+            group.Run([&emitTreelet, t] { emitTreelet(t); });
+        group.Wait();
+    }
+    else
+    {
+        for (int t = 0; t < nTreelets; t++)
+            emitTreelet(t);
+    }
+
+    return _BuildUpperSAH(treelets.data(), 0, nTreelets, totalNodes);
+}
+
+//----------------------------------------------------
+
+// Parallel locally-ordered clustering over the morton sorted "hittableInfo".
+// Every pass finds the nearest neighbor (smallest union area) of each cluster
+// among the "s_plocRadius" clusters on either side, merges the mutual pairs
+// and compacts the list in order. Ties go to the lower index, which orders
+// all pairs strictly, so the closest pair is always mutual and each pass
+// makes progress. It may be a single pair though (nested primitives), so
+// once passes stall the remaining clusters are joined by SAH instead.
+// Finally small subtrees collapse into leaves, which reorders "hittableInfo"
+// to leaf order.
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_BuildPLOC(std::vector<SHittableInfo> &hittableInfo, std::atomic<int> &totalNodes,
+                                                  CThreadPool *pool)
+{
+    const int   nHittables = hittableInfo.size();
+
+    std::vector<SBVHBuildNode*>     clusters(nHittables);
+    std::vector<SBVHBuildNode*>     merged(nHittables);
+    std::vector<int>                neighbors(nHittables);
+    std::vector<int>                chunkOffsets(_ChunkCount(nHittables) + 1);
+
+    // 1. a leaf per hittable
+    _ForEachChunk(pool, 0, nHittables, [&](int, int first, int last) {
+        CMemoryArena    &arena = _GetBuildArena();
+        for (int i = first; i < last; i++)
+        {
+            clusters[i] = arena.Alloc<SBVHBuildNode>();
+            clusters[i]->InitLeaf(i, 1, hittableInfo[i].bounds);
+        }
+    });
+    totalNodes += nHittables;
+
+    int     nClusters = nHittables;
+    while (nClusters > 1)
+    {
+        // 2. nearest neighbor in the window
+        _ForEachChunk(pool, 0, nClusters, [&](int, int first, int last) {
+            for (int i = first; i < last; i++)
+            {
+                CAABB           bounds = clusters[i]->bounds;
+                const int       end = std::min(nClusters, i + s_plocRadius + 1);
+                float           bestArea = std::numeric_limits<float>::max();
+                int             best = -1;
+                for (int j = std::max(0, i - s_plocRadius); j < end; j++)
+                {
+                    if (j == i)
+                        continue;
+
+                    const float     area = (bounds + clusters[j]->bounds).SurfaceArea();
+                    if (area < bestArea)
                     {
-                        int b = nBuckets * centroidBounds.Offset(bvHHittableInfo[i].centroid)[dim];
-                        
-                        if (b == nBuckets)
-                            b = nBuckets - 1;
-                        buckets[b].count++;
-                        buckets[b].bounds = buckets[b].bounds + bvHHittableInfo[i].bounds;
+                        bestArea = area;
+                        best = j;
                     }
+                }
+                neighbors[i] = best;
+            }
+        });
+
+        // 3. mutual neighbors merge into the lower index, the other one is
+        // dropped. Then the survivors are compacted, keeping their order.
+        _ForEachChunk(pool, 0, nClusters, [&](int chunk, int first, int last) {
+            CMemoryArena    &arena = _GetBuildArena();
+            int             nMerges = 0;
+            int             nKept = 0;
+            for (int i = first; i < last; i++)
+            {
+                const int   j = neighbors[i];
+                if (neighbors[j] != i)
+                    merged[i] = clusters[i];
+                else if (i < j)
+                {
+                    SBVHBuildNode   *c0 = clusters[i];
+                    SBVHBuildNode   *c1 = clusters[j];
+                    const glm::vec3 d = glm::abs((c1->bounds.pMin + c1->bounds.pMax) - (c0->bounds.pMin + c0->bounds.pMax));
+                    const int       axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+
+                    merged[i] = arena.Alloc<SBVHBuildNode>();
+                    merged[i]->InitInterior(axis, c0, c1);
+                    nMerges++;
+                }
+                else
+                    merged[i] = nullptr;
+
+                nKept += merged[i] != nullptr;
+            }
+            chunkOffsets[chunk + 1] = nKept;
+            totalNodes += nMerges;
+        });
+
+        const int   nChunks = _ChunkCount(nClusters);
+        chunkOffsets[0] = 0;
+        for (int chunk = 0; chunk < nChunks; chunk++)
+            chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+
+        _ForEachChunk(pool, 0, nClusters, [&](int chunk, int first, int last) {
+            int     offset = chunkOffsets[chunk];
+            for (int i = first; i < last; i++)
+            {
+                if (merged[i] != nullptr)
+                    clusters[offset++] = merged[i];
+            }
+        });
+        const int   nMerges = nClusters - chunkOffsets[nChunks];
+        nClusters = chunkOffsets[nChunks];
+        if (nMerges * s_plocMinMergeRatio < nClusters)
+            break;
+    }
+
+    SBVHBuildNode   *root = _BuildUpperSAH(clusters.data(), 0, nClusters, totalNodes);
+
+    // 4. leaves of up to "m_maxHittablesInNode", where they are cheaper
+    std::vector<SHittableInfo>  orderedInfo;
+    orderedInfo.reserve(nHittables);
+    int                         nNodes = 0;
+    _CollapseLeaves(root, hittableInfo, orderedInfo, nNodes);
+    hittableInfo.swap(orderedInfo);
+    totalNodes = nNodes;
+
+    return root;
+}
+
+//----------------------------------------------------
+
+// Append the leaves of "node" to "orderedInfo" in depth-first order, so every
+// subtree covers a contiguous range, and turn subtrees into one leaf where
+// that does not raise the SAH cost. Returns the cost as in _BuildNodeCost()
+// and adds the remaining nodes to "nNodes".
+float   CBVHAccel::_CollapseLeaves(SBVHBuildNode *node, const std::vector<SHittableInfo> &hittableInfo, std::vector<SHittableInfo> &orderedInfo,
+                                   int &nNodes)
+{
+    const float     area = node->bounds.SurfaceArea();
+    const int       first = orderedInfo.size();
+    if (node->children[0] == nullptr)
+    {
+        for (int i = 0; i < node->nHittables; i++)
+            orderedInfo.push_back(hittableInfo[node->firstHittableOffset + i]);
+        node->firstHittableOffset = first;
+        nNodes++;
+        return node->nHittables * area;
+    }
+
+    int             nSubtreeNodes = 1;
+    const float     cost = area + _CollapseLeaves(node->children[0], hittableInfo, orderedInfo, nSubtreeNodes)
+                                + _CollapseLeaves(node->children[1], hittableInfo, orderedInfo, nSubtreeNodes);
+    const int       nLeafHittables = orderedInfo.size() - first;
+    if (nLeafHittables <= m_maxHittablesInNode && nLeafHittables * area <= cost)
+    {
+        node->InitLeaf(first, nLeafHittables, node->bounds);
+        nNodes++;
+        return nLeafHittables * area;
+    }
+
+    nNodes += nSubtreeNodes;
+    return cost;
+}
+
+//----------------------------------------------------
+
+// Build the subtree over the code sorted range [start, end). The highest bit
+// that differs between the first and last code splits the range, everything
+// above it is shared.
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_EmitLBVH(const std::vector<SHittableInfo> &hittableInfo, const uint64_t *codes, int start, int end,
+                                                 std::atomic<int> &totalNodes, CThreadPool *pool)
+{
+    SBVHBuildNode   *node = _GetBuildArena().Alloc<SBVHBuildNode>();
+    totalNodes++;
+
+    int nHittables = end - start;
+
+    if (nHittables <= std::min(s_lbvhMaxLeafSize, m_maxHittablesInNode))
+    {
+        // create leaf node
+        CAABB   bounds;
+        for (int i = start; i < end; i++)
+            bounds = bounds + hittableInfo[i].bounds;
+        node->InitLeaf(start, nHittables, bounds);
+        return node;
+    }
+
+    int         mid = (start + end) / 2;
+    int         axis = 0;
+    uint64_t    diff = codes[start] ^ codes[end - 1];
+    if (diff != 0)
+    {
+        int     bit = 63;
+        while (!((diff >> bit) & 1))
+            bit--;
+
+        // first code with the split bit set
+        const uint64_t  mask = 1ull << bit;
+        mid = std::partition_point(codes + start, codes + end, [mask](uint64_t code) { return !(code & mask); }) - codes;
+        axis = bit % 3;
+    }
+    // else identical codes, split in the middle
+
+    SBVHBuildNode   *children[2];
+    if (pool != nullptr && nHittables >= s_parallelSubtreeMin)
+    {
+        CTaskGroup  group(*pool);
+        group.Run([&] {
+            children[1] = _EmitLBVH(hittableInfo, codes, mid, end, totalNodes, pool);
+        });
+        children[0] = _EmitLBVH(hittableInfo, codes, start, mid, totalNodes, pool);
+        group.Wait();
+    }
+    else
+    {
+        children[0] = _EmitLBVH(hittableInfo, codes, start, mid, totalNodes, nullptr);
+        children[1] = _EmitLBVH(hittableInfo, codes, mid, end, totalNodes, nullptr);
+    }
+    node->InitInterior(axis, children[0], children[1]);
 
-                    // Compute costs for splitting after each bucket
-                    float   cost[nBuckets - 1];
-                    for (int i = 0; i < nBuckets - 1; i++)
+    return node;
+}
+
+//----------------------------------------------------
+
+// SAH over the HLBVH treelet roots or the clusters left by PLOC, serially
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_BuildUpperSAH(SBVHBuildNode **roots, int start, int end, std::atomic<int> &totalNodes)
+{
+    int nNodes = end - start;
+    if (nNodes == 1)
+        return roots[start];
+
+    SBVHBuildNode   *node = _GetBuildArena().Alloc<SBVHBuildNode>();
+    totalNodes++;
+
+    CAABB   bounds, centroidBounds;
+    for (int i = start; i < end; i++)
+    {
+        bounds = bounds + roots[i]->bounds;
+        centroidBounds = centroidBounds + roots[i]->bounds.Centroid();
+    }
+
+    int dim = centroidBounds.MaxExtent();
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] > centroidBounds.pMin[dim])
+    {
+        auto    bucketOf = [&](const SBVHBuildNode *root) {
+            int b = s_nBuckets * centroidBounds.Offset(root->bounds.Centroid())[dim];
+            return std::min(b, s_nBuckets - 1);
+        };
+
+        SBucketInfo     buckets[s_nBuckets];
+        for (int i = start; i < end; i++)
+        {
+            SBucketInfo     &bucket = buckets[bucketOf(roots[i])];
+            bucket.count++;
+            bucket.bounds = bucket.bounds + roots[i]->bounds;
+        }
+
+        // the treelets must be split, so only the relative cost matters
+        float   minCost = std::numeric_limits<float>::max();
+        int     minCostSplitBucket = 0;
+        for (int i = 0; i < s_nBuckets - 1; i++)
+        {
+            CAABB   b0, b1;
+            int     count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; j++)
+            {
+                b0 = b0 + buckets[j].bounds;
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < s_nBuckets; j++)
+            {
+                b1 = b1 + buckets[j].bounds;
+                count1 += buckets[j].count;
+            }
+
+            float   cost = count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea();
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+
+        SBVHBuildNode   **pmid = std::partition(&roots[start], &roots[end - 1] + 1,
+            [&](const SBVHBuildNode *root) { return bucketOf(root) <= minCostSplitBucket; });
+        mid = pmid - &roots[0];
+        if (mid == start || mid == end)
+            mid = (start + end) / 2;
+    }
+
+    node->InitInterior(dim, _BuildUpperSAH(roots, start, mid, totalNodes), _BuildUpperSAH(roots, mid, end, totalNodes));
+
+    return node;
+}
+
+//----------------------------------------------------
+
+// sum of the node areas weighted as in ComputeSAHCost(), not normalized
+float   CBVHAccel::_BuildNodeCost(const SBVHBuildNode *node)
+{
+    if (node->children[0] == nullptr)
+        return node->nHittables * node->bounds.SurfaceArea();
+
+    return node->bounds.SurfaceArea() + _BuildNodeCost(node->children[0]) + _BuildNodeCost(node->children[1]);
+}
+
+//----------------------------------------------------
+
+// Treelet restructuring (Karras and Aila, "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies"). A treelet grows from its root
+// by opening its largest interior leaf until it has "s_treeletLeaves" leaves,
+// which are then rearranged into the topology of least SAH cost. Treelet
+// leaves keep their bounds, so the tree is cut into disjoint treelets that
+// are optimized in parallel. Later rounds cut the changed tree again.
+void    CBVHAccel::_RestructureTreelets(SBVHBuildNode *root, CThreadPool *pool)
+{
+    if (root->children[0] == nullptr)
+        return;
+
+    struct STreelet
+    {
+        SBVHBuildNode   *leaves[s_treeletLeaves];
+        SBVHBuildNode   *interiors[s_treeletLeaves - 1];    // "interiors[0]" is the root
+        int             nLeaves;
+    };
+
+    auto    begin = std::chrono::steady_clock::now();
+    const float     rootArea = root->bounds.SurfaceArea();
+    const float     initialCost = _BuildNodeCost(root) / rootArea;
+    float           cost = initialCost;
+    int             nRounds = 0;
+
+    std::vector<STreelet>       treelets;
+    std::vector<SBVHBuildNode*> roots;
+    while (nRounds < s_treeletRounds)
+    {
+        // 1. cut the tree into treelets top-down. The top treelet shrinks
+        // every round, which shifts the treelet boundaries below.
+        const int   rootLeaves = s_treeletLeaves - 2 * (nRounds % 3);
+        treelets.clear();
+        roots.assign(1, root);
+        while (!roots.empty())
+        {
+            SBVHBuildNode   *node = roots.back();
+            roots.pop_back();
+
+            STreelet    treelet;
+            treelet.interiors[0] = node;
+            treelet.leaves[0] = node->children[0];
+            treelet.leaves[1] = node->children[1];
+            treelet.nLeaves = 2;
+
+            const int   maxLeaves = node == root ? rootLeaves : s_treeletLeaves;
+            while (treelet.nLeaves < maxLeaves)
+            {
+                int     best = -1;
+                float   bestArea = -1.f;
+                for (int i = 0; i < treelet.nLeaves; i++)
+                {
+                    const SBVHBuildNode *leaf = treelet.leaves[i];
+                    if (leaf->children[0] != nullptr && leaf->bounds.SurfaceArea() > bestArea)
                     {
-                        CAABB b0, b1;
-                        int count0 = 0, count1 = 0;
-                        for (int j = 0; j <= i; j++)
-                        {
-                            b0 = b0 + buckets[j].bounds;
-                            count0 += buckets[j].count;
-                        }
-                        for (int j = i + 1; j < nBuckets; j++)
-                        {
-                            b1 = b1 + buckets[j].bounds;
-                            count1 += buckets[j].count;
-                        }
-                        cost[i] = 1 + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / topBound.SurfaceArea();
+                        best = i;
+                        bestArea = leaf->bounds.SurfaceArea();
                     }
+                }
+                if (best < 0)
+                    break;
+
+                SBVHBuildNode   *open = treelet.leaves[best];
+                treelet.interiors[treelet.nLeaves - 1] = open;
+                treelet.leaves[best] = open->children[0];
+                treelet.leaves[treelet.nLeaves++] = open->children[1];
+            }
+
+            for (int i = 0; i < treelet.nLeaves; i++)
+            {
+                if (treelet.leaves[i]->children[0] != nullptr)
+                    roots.push_back(treelet.leaves[i]);
+            }
+            if (treelet.nLeaves > 2)
+                treelets.push_back(treelet);
+        }
 
-                    // Find bucket to split at that minimizes SAH metric
-                    float   minCost = cost[0];
-                    int     minCostSplitBucket = 0;
-                    for (int i = 1; i < nBuckets - 1; i++)
+        // 2. optimal topology of every treelet by dynamic programming over
+        // the subsets of its leaves. Leaf subtrees are fixed, so only the
+        // interior areas count.
+        _ForEachChunk(pool, 0, treelets.size(), [&](int, int first, int last) {
+            CAABB       bounds[1 << s_treeletLeaves];
+            float       area[1 << s_treeletLeaves];
+            float       subsetCost[1 << s_treeletLeaves];
+            uint8_t     split[1 << s_treeletLeaves];
+
+            for (int t = first; t < last; t++)
+            {
+                STreelet    &treelet = treelets[t];
+                const int   n = treelet.nLeaves;
+                const int   all = (1 << n) - 1;
+
+                // a subset is its highest leaf added to a smaller subset
+                for (int i = 0; i < n; i++)
+                {
+                    const int   bit = 1 << i;
+                    bounds[bit] = treelet.leaves[i]->bounds;
+                    area[bit] = 0.f;
+                    for (int s = 1; s < bit; s++)
                     {
-                        if(cost[i] < minCost)
-                        {
-                            minCost = cost[i];
-                            minCostSplitBucket = i;
-                        }
+                        bounds[bit | s] = bounds[s] + bounds[bit];
+                        area[bit | s] = bounds[bit | s].SurfaceArea();
                     }
+                }
 
-                    // Either create leaf or split primitives at selected SAH bucket
-                    float   leafCost = nHittables;
-                    if (nHittables > m_maxHittablesInNode || minCost < leafCost)
+                // submasks are smaller than their set, so they are done first
+                for (int s = 1; s <= all; s++)
+                {
+                    if ((s & (s - 1)) == 0)
                     {
-                        SHittableInfo *pmid = std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, 
-                            [=](const SHittableInfo &pi) {
-                                int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim]; 
-                                if (b == nBuckets)
-                                    b = nBuckets - 1;
-                                return b <= minCostSplitBucket; });
-                        mid = pmid - &bvHHittableInfo[0];
+                        subsetCost[s] = 0.f;
+                        continue;
                     }
-                    // create leaf BVHBuild node
-                    else 
+
+                    // splits with the lowest leaf on the left, each one once:
+                    // "p" runs over the submasks of the other leaves
+                    const int   lowest = s & -s;
+                    const int   rest = s ^ lowest;
+                    float       bestCost = std::numeric_limits<float>::max();
+                    for (int q = (rest - 1) & rest;; q = (q - 1) & rest)
                     {
-                        int     firstPrimOffset = orderedHittables.size();
-                        for (int i = start; i < end; i++)
+                        const int       p = q | lowest;
+                        const float     c = subsetCost[p] + subsetCost[s ^ p];
+                        if (c < bestCost)
                         {
-                            int hittableNum = bvHHittableInfo[i].hittableNum;
-                            orderedHittables.push_back(m_hittables[hittableNum]);
+                            bestCost = c;
+                            split[s] = p;
                         }
-                        node->InitLeaf(firstPrimOffset, nHittables, topBound);
-                        return node;
+                        if (q == 0)
+                            break;
                     }
+                    subsetCost[s] = area[s] + bestCost;
                 }
+
+                float   currentCost = 0.f;
+                for (int i = 0; i < n - 1; i++)
+                    currentCost += treelet.interiors[i]->bounds.SurfaceArea();
+                if (subsetCost[all] >= currentCost)
+                    continue;
+
+                // reuse the interior nodes. The root keeps its bounds, it is
+                // a leaf of the treelet above that may be read concurrently.
+                int     nextInterior = 0;
+                auto    emit = [&](auto &self, int s) -> SBVHBuildNode* {
+                    if ((s & (s - 1)) == 0)
+                    {
+                        int     i = 0;
+                        while (!(s & (1 << i)))
+                            i++;
+                        return treelet.leaves[i];
+                    }
+
+                    SBVHBuildNode   *node = treelet.interiors[nextInterior++];
+                    SBVHBuildNode   *c0 = self(self, split[s]);
+                    SBVHBuildNode   *c1 = self(self, s ^ split[s]);
+
+                    const glm::vec3 d = glm::abs((c1->bounds.pMin + c1->bounds.pMax) - (c0->bounds.pMin + c0->bounds.pMax));
+                    const int       axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+                    if (node == treelet.interiors[0])
+                    {
+                        node->children[0] = c0;
+                        node->children[1] = c1;
+                        node->splitAxis = axis;
+                    }
+                    else
+                        node->InitInterior(axis, c0, c1);
+                    return node;
+                };
+                emit(emit, all);
+            }
+        });
+
+        nRounds++;
+        const float     newCost = _BuildNodeCost(root) / rootArea;
+        const bool      converged = newCost > cost * 0.999f;
+        cost = newCost;
+        if (converged)
+            break;
+    }
+
+    float   ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    printf("[BVH] Treelet restructuring: SAH cost %.2f -> %.2f, %d round(s) over %zu treelets in %.2f ms\n",
+           initialCost, cost, nRounds, treelets.size(), ms);
+}
+
+//----------------------------------------------------
+
+// Collapse the binary subtree at "nodeIndex" into a wide node by opening the
+// interior child with the largest surface area until 4 children are found.
+int CBVHAccel::_CollapseWide(int nodeIndex)
+{
+    int     children[4];
+    int     nChildren = 0;
+
+    const SLinearBVHNode    &node = m_nodes[nodeIndex];
+    if (node.nHittables > 0)    // leaf root
+        children[nChildren++] = nodeIndex;
+    else
+    {
+        children[nChildren++] = nodeIndex + 1;
+        children[nChildren++] = node.secondChildOffset;
+    }
+
+    while (nChildren < 4)
+    {
+        int     best = -1;
+        float   bestArea = -1.f;
+        for (int i = 0; i < nChildren; i++)
+        {
+            const SLinearBVHNode    &child = m_nodes[children[i]];
+            if (child.nHittables == 0 && child.bounds.SurfaceArea() > bestArea)
+            {
+                best = i;
+                bestArea = child.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+
+        const int   open = children[best];
+        children[best] = open + 1;
+        children[nChildren++] = m_nodes[open].secondChildOffset;
+    }
+
+    // children are filled after recursing, which may grow "m_wideNodes"
+    const int       wideIndex = m_wideNodes.size();
+    m_wideNodes.emplace_back();
+    m_wideChildNodes.resize(4 * m_wideNodes.size(), -1);
+
+    int32_t     childIndex[4];
+    for (int i = 0; i < nChildren; i++)
+    {
+        const SLinearBVHNode    &child = m_nodes[children[i]];
+        childIndex[i] = child.nHittables > 0 ? child.hittablesOffset : _CollapseWide(children[i]);
+    }
+
+    SWideBVHNode    &wideNode = m_wideNodes[wideIndex];
+    memset(&wideNode, 0, sizeof(wideNode));
+    wideNode.nChildren = nChildren;
+    for (int i = 0; i < nChildren; i++)
+    {
+        const SLinearBVHNode    &child = m_nodes[children[i]];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            wideNode.bounds[0][axis][i] = child.bounds.pMin[axis];
+            wideNode.bounds[1][axis][i] = child.bounds.pMax[axis];
+        }
+        wideNode.children[i] = childIndex[i];
+        wideNode.nHittables[i] = child.nHittables;
+        m_wideChildNodes[4 * wideIndex + i] = children[i];
+    }
+
+    return wideIndex;
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::Compress()
+{
+    // shared trees (e.g. instanced meshes) are reached more than once
+    if (IsEmpty() || m_isCompressed)
+        return;
+
+    const u_int32_t     nReplicas = m_replicas.size();
+    const size_t        wideBytes = m_wideNodes.size() * sizeof(SWideBVHNode);
+    _FreeReplicas();
+
+    m_isCompressed = true;
+    _QuantizeWide();
+    printf("[BVH] Compressed %zu wide nodes, %.2f MB -> %.2f MB\n", m_quantizedNodes.size(), wideBytes / (1024.f * 1024.f),
+           m_quantizedNodes.size() * sizeof(SQuantizedBVHNode) / (1024.f * 1024.f));
+
+    if (nReplicas > 0)
+        ReplicateNuma(nReplicas);
+
+    // nested acceleration structures (e.g. meshes) compress their own nodes
+    for (const auto &hittable : m_hittables)
+        hittable->CompressBVH();
+}
+
+//----------------------------------------------------
+
+// "m_wideNodes" into "m_quantizedNodes", the full precision nodes are freed
+void    CBVHAccel::_QuantizeWide()
+{
+    m_quantizedNodes.resize(m_wideNodes.size());
+    for (size_t i = 0; i < m_wideNodes.size(); i++)
+    {
+        const SWideBVHNode  &wideNode = m_wideNodes[i];
+        SQuantizedBVHNode   &quantizedNode = m_quantizedNodes[i];
+        CAABB               childBounds[4];
+
+        memset(&quantizedNode, 0, sizeof(quantizedNode));
+        quantizedNode.nChildren = wideNode.nChildren;
+        for (int c = 0; c < wideNode.nChildren; c++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                childBounds[c].pMin[axis] = wideNode.bounds[0][axis][c];
+                childBounds[c].pMax[axis] = wideNode.bounds[1][axis][c];
+            }
+            quantizedNode.children[c] = wideNode.children[c];
+            quantizedNode.nHittables[c] = wideNode.nHittables[c];
+        }
+        _QuantizeBounds(quantizedNode, childBounds, wideNode.nChildren);
+    }
+
+    std::vector<SWideBVHNode>().swap(m_wideNodes);
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_QuantizeBounds(SQuantizedBVHNode &node, const CAABB *childBounds, int nChildren)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float   lo = childBounds[0].pMin[axis];
+        float   hi = childBounds[0].pMax[axis];
+        for (int c = 1; c < nChildren; c++)
+        {
+            lo = std::min(lo, childBounds[c].pMin[axis]);
+            hi = std::max(hi, childBounds[c].pMax[axis]);
+        }
+
+        // finest power of two scale spanning [lo, hi] in 255 steps. It also
+        // keeps |origin| / scale below 2^23, so "origin + q * scale" is exact
+        // in float and the decoded bounds are exactly the rounded ones.
+        int     magnitudeExp, rangeExp;
+        frexp(std::max(std::fabs(lo), std::fabs(hi)), &magnitudeExp);
+        frexp(((double)hi - lo) / 255.0, &rangeExp);
+        int     exponent = std::max(std::max(magnitudeExp - 23, rangeExp), -126);
+
+        double  scale, origin;
+        for (;; exponent++)
+        {
+            scale = ldexp(1.0, exponent);
+            origin = floor(lo / scale) * scale;
+            if (origin + 255.0 * scale >= hi)
                 break;
-            }}
+        }
+
+        node.origin[axis] = (float)origin;
+        node.exponent[axis] = exponent + 127;
 
-            // build nodes
-            node->InitInterior(dim,
-                               _RecursiveBuild(bvHHittableInfo, start, mid, totalNodes, orderedHittables),
-                               _RecursiveBuild(bvHHittableInfo, mid, end, totalNodes, orderedHittables));
+        // min rounds down and max up, re-checked since the divisions round
+        for (int c = 0; c < 4; c++)
+        {
+            if (c >= nChildren)
+            {
+                node.bounds[0][axis][c] = node.bounds[1][axis][c] = 0;
+                continue;
+            }
+
+            const float     cMin = childBounds[c].pMin[axis];
+            const float     cMax = childBounds[c].pMax[axis];
+            int             qMin = std::max(0, std::min(255, (int)floor((cMin - origin) / scale)));
+            int             qMax = std::max(0, std::min(255, (int)ceil((cMax - origin) / scale)));
+            while (qMin > 0 && origin + qMin * scale > cMin)
+                qMin--;
+            while (qMax < 255 && origin + qMax * scale < cMax)
+                qMax++;
+
+            node.bounds[0][axis][c] = qMin;
+            node.bounds[1][axis][c] = qMax;
         }
     }
+}
 
-    return node;
-};
+//----------------------------------------------------
+
+const CBVHAccel::TBoundsSlice*  CBVHAccel::_DecodeBounds(const SQuantizedBVHNode &node, TBoundsSlice *scratch)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const u_int32_t     scaleBits = (u_int32_t)node.exponent[axis] << 23;
+        float               scale;
+        memcpy(&scale, &scaleBits, sizeof(scale));
+#if defined(__SSE2__)
+        // widen the 4 bytes of a min or max row to floats
+        const __m128    origin = _mm_set1_ps(node.origin[axis]);
+        const __m128    scale4 = _mm_set1_ps(scale);
+        const __m128i   zero = _mm_setzero_si128();
+        for (int k = 0; k < 2; k++)
+        {
+            int32_t     packed;
+            memcpy(&packed, node.bounds[k][axis], sizeof(packed));
+            __m128i     q = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+            q = _mm_unpacklo_epi16(q, zero);
+            _mm_store_ps(scratch[k][axis], _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q), scale4)));
+        }
+#else
+        for (int k = 0; k < 2; k++)
+            for (int c = 0; c < 4; c++)
+                scratch[k][axis][c] = node.origin[axis] + node.bounds[k][axis][c] * scale;
+#endif
+    }
+
+    return scratch;
+}
+
+//----------------------------------------------------
+
+// The build thread uses the first arena and every worker of the build pool
+// its own. Any other thread running a build task, e.g. one waiting on its
+// own task group of the same pool, gets an arena of its own too.
+CMemoryArena&   CBVHAccel::_GetBuildArena()
+{
+    const int   worker = m_buildPool != nullptr ? m_buildPool->GetCurrentWorker() : -1;
+    if (worker >= 0)
+        return *m_buildArenas[worker + 1];
+    if (std::this_thread::get_id() == m_buildThread)
+        return *m_buildArenas[0];
+
+    std::lock_guard<std::mutex>     lock(m_helperArenaMutex);
+    std::unique_ptr<CMemoryArena>   &arena = m_helperArenas[std::this_thread::get_id()];
+    if (arena == nullptr)
+        arena = std::make_unique<CMemoryArena>();
+    return *arena;
+}
+
+//----------------------------------------------------
+
+float   CBVHAccel::ComputeSAHCost() const
+{
+    if (IsEmpty())
+        return 0.f;
+
+    float   cost = 0.f;
+    for (int i = 0; i < m_totalNodes; i++)
+    {
+        const SLinearBVHNode    &node = m_nodes[i];
+        float                   area = node.bounds.SurfaceArea();
+        cost += node.nHittables > 0 ? node.nHittables * area : area;
+    }
+
+    return cost / m_nodes[0].bounds.SurfaceArea();
+}
 
 //----------------------------------------------------
 
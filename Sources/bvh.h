@@ -13,17 +13,69 @@
 *		Rendering" chaper4.3, Bounding Volume Hierarchies.
 *		https://www.pbrt.org/
 *
+*		Given a thread pool, large nodes are binned in parallel and
+*		independent subtrees are built as separate tasks. The result
+*		is identical to the serial build.
+*
+*		Build nodes and scratch data live in per-thread arenas that
+*		are released in one go once the tree is flattened.
+*
+*		LBVH sorts primitives along a 30/63-bit Morton curve and emits
+*		the hierarchy from the sorted codes in linear time. HLBVH does
+*		the same for small treelets and joins them with SAH, trading
+*		some traversal speed of SAH for much faster (re)builds.
+*
+*		PLOC starts from the same Morton order with one cluster per
+*		primitive and merges mutual nearest neighbors, searched in a
+*		small window of the order, in parallel passes bottom-up
+*		(Meister and Bittner 2018). Passes that stall leave the rest
+*		to SAH, then small subtrees collapse into leaves. Its SAH cost
+*		is 4% above SAH on the croissant and below it on large
+*		triangle soups, and every pass is data parallel.
+*
+*		SBVH also considers spatial splits that clip primitives at the
+*		split plane and reference them from both children, so long
+*		overlapping triangles stop inflating their neighbors' boxes.
+*		The number of duplicated references is capped.
+*
+*		Optionally the binary tree is restructured before flattening:
+*		small treelets are rearranged into their optimal SAH topology
+*		(Karras and Aila 2013), independent treelets in parallel.
+*
+*		Triangles and spheres are also copied into contiguous arrays in
+*		leaf order, so leaves test them without a pointer chase or a
+*		virtual call. Other hittables (meshes, instances) stay behind
+*		their IHittable interface.
+*
+*		Refit() updates the bounds of an existing tree after the
+*		hittables moved, and rebuilds it once its SAH cost degraded.
+*
+*		The flattened binary tree stays the canonical representation.
+*		For traversal it is collapsed into a 4-wide tree whose child
+*		boxes are tested with one SIMD slab test, nearest child first.
+*
+*		Compress() swaps the 128 byte wide nodes for 64 byte ones with
+*		8-bit child bounds relative to the node box, rounded outwards
+*		so a ray never misses a child it would have hit.
+*
 **************************************************************************/
 
 #include "common.h"
 #include "aabb.h"
 #include "ray.h"
+#include "memory_arena.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
 struct SHitRec;
 class IHittable;
+class CThreadPool;
 
 //----------------------------------------------------
 
@@ -67,6 +119,7 @@ class CBVHAccel
         SBVHBuildNode   *children[2];
         int             splitAxis, firstHittableOffset, nHittables;
         CAABB           bounds;
+        const size_t    *hittableNums = nullptr;    // SBVH leaves, offset assigned after the build
     };
 
     struct SLinearBVHNode
@@ -82,33 +135,197 @@ class CBVHAccel
         CAABB       bounds;
     };
 
+    // 4-wide traversal node, child bounds in SoA layout so one SSE slab test
+    // covers every child. Children are packed at the front.
+    struct alignas(16) SWideBVHNode
+    {
+        float       bounds[2][3][4];    // [min/max][axis][child], octant indexed
+        int32_t     children[4];        // interior: wide node index, leaf: hittables offset
+        uint16_t    nHittables[4];      // 0 -> interior child
+        uint8_t     nChildren;
+        uint8_t     pad[7];             // ensure 128 byte total size
+    };
+
+    // SWideBVHNode with child bounds quantized per axis on a power of two
+    // grid: origin + q * 2^(exponent - 127). Origins are multiples of the
+    // scale, so the decoded bounds are exact and only the rounding of "q"
+    // (down for min, up for max) loosens them.
+    struct alignas(64) SQuantizedBVHNode
+    {
+        float       origin[3];
+        uint8_t     exponent[3];        // float exponent bits of the scale
+        uint8_t     nChildren;
+        uint8_t     bounds[2][3][4];    // [min/max][axis][child], octant indexed
+        int32_t     children[4];        // interior: node index, leaf: hittables offset
+        uint16_t    nHittables[4];      // 0 -> interior child
+    };
+
     struct SBucketInfo
     {
         int     count = 0;
         CAABB   bounds;
+        CAABB   centroidBounds;     // lets children skip recomputing theirs
+    };
+
+    // Leaf primitives by type. A leaf range of hittables holds its triangles,
+    // then its spheres, then the rest, and the packed copies follow the same
+    // order. Only the geometry is packed, the hittable fills the hit record.
+    struct SPackedTriangle
+    {
+        glm::vec3   v0;
+        glm::vec3   edge1;          // v1 - v0
+        glm::vec3   edge2;          // v2 - v0
+    };
+
+    struct SPackedSphere
+    {
+        glm::vec3   origin;
+        float       radius;
+    };
+
+    // packed triangles and spheres before a hittable slot, one more entry
+    // than slots. A leaf [first, first + n) scans the packed ranges between
+    // its two entries.
+    struct SPackedOffsets
+    {
+        int32_t     triangles;
+        int32_t     spheres;
+    };
+
+    // per NUMA node copy of the read-only traversal data
+    struct SNumaReplica
+    {
+        SWideBVHNode        *wideNodes = nullptr;
+        SQuantizedBVHNode   *quantizedNodes = nullptr;  // instead of "wideNodes" once compressed
+        const IHittable     **hittables = nullptr;
+        SPackedTriangle     *triangles = nullptr;
+        SPackedSphere       *spheres = nullptr;
+        SPackedOffsets      *packedOffsets = nullptr;
     };
 
 public:
-    enum EPartitionType { MIDPOINT, EQUALSUBSET, SAH };
+    enum EPartitionType { MIDPOINT, EQUALSUBSET, SAH, LBVH, HLBVH, SBVH, PLOC };
 
     //constructor
     CBVHAccel();
-    CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType);
+    // "pool" (optional) parallelizes the build, it is not kept afterwards.
+    // "restructure" spends extra build time on treelet optimization for a
+    // lower SAH cost, for static scenes.
+    CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType,
+              CThreadPool *pool = nullptr, bool restructure = false);
+    // Adopt a tree flattened by an earlier build, see GetNodes(). "hittables"
+    // are already in leaf order, "hittableOrder" gives their original index.
+    // The nodes are used in place and "nodeStorage" keeps them alive, e.g. a
+    // mapped cache file.
+    CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const u_int32_t *hittableOrder, int maxHittablesInNode,
+              EPartitionType partitionType, bool restructure, void *nodes, int nNodes, float sahCost,
+              const std::shared_ptr<void> &nodeStorage);
     ~CBVHAccel();
 
+    // owns the flattened nodes
+    CBVHAccel(const CBVHAccel&) = delete;
+    CBVHAccel&      operator= (const CBVHAccel&) = delete;
+
     bool            Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const;
+    // any intersection in [t_min, t_max], without a hit record
+    bool            Occluded(const CRay &ray, float t_min, float t_max) const;
     inline bool     IsEmpty() const { return (m_nodes == nullptr); }
     void            Clear();
 
+    // Update the node bounds bottom-up after the hittables moved (their
+    // "m_aabb" changed), keeping the tree topology. Once the SAH cost grew
+    // past "maxCostGrowth" times the cost after the last build, the tree is
+    // rebuilt instead. Returns true if it was rebuilt.
+    bool            Refit(CThreadPool *pool = nullptr, float maxCostGrowth = 2.f);
+
+    // expected cost of a random ray relative to the root surface area, with
+    // traversal and intersection cost 1 (same units as the SAH build)
+    float           ComputeSAHCost() const;
+
+    // flattened tree for caching, GetNodeSize() bytes per node
+    const void*     GetNodes() const { return m_nodes; }
+    int             GetNodeCount() const { return m_totalNodes; }
+    static u_int32_t    GetNodeSize() { return sizeof(SLinearBVHNode); }
+    // whether "nodes" can be adopted, e.g. from an untrusted cache file: one
+    // depth-first tree with every leaf inside the "nHittables" slots, not
+    // deeper than the traversal stack allows
+    static bool     IsValidTree(const void *nodes, int nNodes, int nHittables);
+    // original index of the hittable in every leaf slot
+    const std::vector<u_int32_t>&   GetHittableOrder() const { return m_hittableOrder; }
+    int             GetMaxHittablesInNode() const { return m_maxHittablesInNode; }
+    EPartitionType  GetPartitionType() const { return m_partitionMethod; }
+    bool            IsRestructured() const { return m_restructure; }
+    float           GetBuildSAHCost() const { return m_buildSAHCost; }
+
+    // Quantize the traversal nodes to half their size, trading a few more
+    // box hits for memory bandwidth. Rebuilds and refits keep the format.
+    void            Compress();
+    bool            IsCompressed() const { return m_isCompressed; }
+
+    // Copy the traversal nodes and primitive table into memory bound to each
+    // NUMA node. Hit() then reads the copy local to the calling worker.
+    void            ReplicateNuma(u_int32_t nNodes);
+
 private:
-    bool            _BuildTree();
-    SBVHBuildNode*  _RecursiveBuild(std::vector<SHittableInfo> &hittableInfo, int start, int end, int *totalNodes, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
+    typedef float   TBoundsSlice[3][4];     // [axis][child] of the min or max child bounds
+
+    // "nodes" or their copy "replicaNodes" on the NUMA node of the caller
+    template <bool anyHit, typename TNode>
+    bool            _Traverse(const TNode *nodes, TNode *SNumaReplica::*replicaNodes,
+                              const CRay &ray, float t_min, float t_max, SHitRec *hitRec) const;
+    // [min/max] child bounds of a traversal node, decoded into "scratch" if quantized
+    static const TBoundsSlice*  _DecodeBounds(const SWideBVHNode &node, TBoundsSlice *) { return node.bounds; }
+    static const TBoundsSlice*  _DecodeBounds(const SQuantizedBVHNode &node, TBoundsSlice *scratch);
+    bool            _BuildTree(CThreadPool *pool);
+    SBVHBuildNode*  _RecursiveBuild(std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds, const CAABB &centroidBounds,
+                                    std::atomic<int> &totalNodes, CThreadPool *pool);
+    SBVHBuildNode*  _RecursiveBuildSpatial(std::vector<SHittableInfo> &refs, const CAABB &bounds, const CAABB &centroidBounds, int refBudget, int depth,
+                                           float rootArea, std::atomic<int> &totalNodes, CThreadPool *pool);
+    void            _GatherSpatialLeaves(SBVHBuildNode *node, std::vector<SHittableInfo> &hittableInfo);
+    SBVHBuildNode*  _BuildLBVH(std::vector<SHittableInfo> &hittableInfo, const CAABB &centroidBounds, std::atomic<int> &totalNodes, CThreadPool *pool);
+    SBVHBuildNode*  _BuildPLOC(std::vector<SHittableInfo> &hittableInfo, std::atomic<int> &totalNodes, CThreadPool *pool);
+    float           _CollapseLeaves(SBVHBuildNode *node, const std::vector<SHittableInfo> &hittableInfo, std::vector<SHittableInfo> &orderedInfo,
+                                    int &nNodes);
+    SBVHBuildNode*  _EmitLBVH(const std::vector<SHittableInfo> &hittableInfo, const uint64_t *codes, int start, int end,
+                              std::atomic<int> &totalNodes, CThreadPool *pool);
+    SBVHBuildNode*  _BuildUpperSAH(SBVHBuildNode **roots, int start, int end, std::atomic<int> &totalNodes);
+    void            _ComputeBounds(const std::vector<SHittableInfo> &hittableInfo, int start, int end, CAABB &bounds, CAABB &centroidBounds, CThreadPool *pool);
+    void            _RestructureTreelets(SBVHBuildNode *root, CThreadPool *pool);
+    static float    _BuildNodeCost(const SBVHBuildNode *node);
     int             _FlattenBVHTree(SBVHBuildNode *node, int *offset);
+    int             _CollapseWide(int nodeIndex);
+    void            _QuantizeWide();
+    static void     _QuantizeBounds(SQuantizedBVHNode &node, const CAABB *childBounds, int nChildren);
+    CMemoryArena&   _GetBuildArena();
+    void            _FreeReplicas();
+    void            _PackPrimitives();
+    void            _PackPrimitive(int slot);
+    void            _FreeNodes();
 
     int                                     m_maxHittablesInNode;
     EPartitionType                          m_partitionMethod;
+    bool                                    m_restructure = false;
     std::vector<std::shared_ptr<IHittable>> m_hittables;
+    std::vector<const IHittable*>           m_hittablePtrs;     // raw view of "m_hittables" for traversal
     SLinearBVHNode*                         m_nodes = nullptr;
+    std::shared_ptr<void>                   m_nodeStorage;      // owns "m_nodes" if they were adopted, else new[]
+    std::vector<u_int32_t>                  m_hittableOrder;    // original index of "m_hittables" entries
+    std::vector<SPackedTriangle>            m_packedTriangles;  // leaf order copies, see SPackedOffsets
+    std::vector<SPackedSphere>              m_packedSpheres;
+    std::vector<SPackedOffsets>             m_packedOffsets;
+    int                                     m_totalNodes = 0;
+    std::vector<SWideBVHNode>               m_wideNodes;        // traversal copy of "m_nodes"
+    std::vector<SQuantizedBVHNode>          m_quantizedNodes;   // replaces "m_wideNodes" once compressed
+    std::vector<int32_t>                    m_wideChildNodes;   // binary node of each wide node child, 4 per wide node
+    bool                                    m_isCompressed = false;
+    float                                   m_buildSAHCost = 0.f;
+    std::vector<SNumaReplica>               m_replicas;
+    // build context, see _GetBuildArena(). Empty after the build.
+    CThreadPool                                 *m_buildPool = nullptr;
+    std::thread::id                             m_buildThread;
+    std::vector<std::unique_ptr<CMemoryArena>>  m_buildArenas;      // the build thread, then one per pool worker
+    std::unordered_map<std::thread::id, std::unique_ptr<CMemoryArena>>  m_helperArenas;
+    std::mutex                                  m_helperArenaMutex;
 
 };
 
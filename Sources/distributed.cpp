@@ -0,0 +1,324 @@
+#include "distributed.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+CTileCoordinator::CTileCoordinator(const SRenderSetting &setting, const std::string &meshFile, u_int32_t nProcesses)
+: m_setting(setting)
+, m_meshFile(meshFile)
+, m_workers(std::max(1u, nProcesses))
+, m_isReady(false)
+{
+    if (m_setting.nThreads == 0)
+        m_setting.nThreads = std::max(1u, std::thread::hardware_concurrency() / (u_int32_t)m_workers.size());
+
+    // a crashed worker must surface as a write error, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+
+    CRenderer::BuildTiles(m_setting, m_tiles, m_pixelOrder);
+    m_isReady = _Spawn();
+}
+
+//----------------------------------------------------
+
+CTileCoordinator::~CTileCoordinator()
+{
+    _Shutdown();
+}
+
+//----------------------------------------------------
+
+bool    CTileCoordinator::Render(float *accum, u_int32_t sampleBegin, u_int32_t sampleEnd)
+{
+    if (!m_isReady)
+        return false;
+
+    printf("[Dist] Rendering %zu tiles on %zu processes x %u threads...\n",
+           m_tiles.size(), m_workers.size(), m_setting.nThreads);
+    fflush(stdout);
+
+    // keep every worker thread busy while results travel back
+    const int   maxInFlight = 2 * m_setting.nThreads;
+    size_t      nextTile = 0;
+    size_t      doneTiles = 0;
+
+    auto    sendTiles = [&](SWorkerProcess &worker) {
+        while (worker.inFlight < maxInFlight && nextTile < m_tiles.size())
+        {
+            STileRequest    request = { (int32_t)nextTile, sampleBegin, sampleEnd };
+            if (!_WriteAll(worker.fd, &request, sizeof(request)))
+                return false;
+            worker.inFlight++;
+            nextTile++;
+        }
+        return true;
+    };
+
+    for (SWorkerProcess &worker : m_workers)
+        worker.nTiles = 0;
+
+    for (SWorkerProcess &worker : m_workers)
+    {
+        if (!sendTiles(worker))
+        {
+            printf("[Dist] Error: Lost worker process %d\n", worker.pid);
+            return false;
+        }
+    }
+
+    std::vector<pollfd>     fds(m_workers.size());
+    std::vector<float>      tileData;
+    while (doneTiles < m_tiles.size())
+    {
+        for (size_t i = 0; i < m_workers.size(); i++)
+            fds[i] = { m_workers[i].fd, POLLIN, 0 };
+
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("[Dist] Error: poll failed\n");
+            return false;
+        }
+
+        for (size_t i = 0; i < m_workers.size(); i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            SWorkerProcess      &worker = m_workers[i];
+            STileResultHeader   header;
+            if (!_ReadAll(worker.fd, &header, sizeof(header)) ||
+                header.tileIndex < 0 || header.tileIndex >= (int32_t)m_tiles.size())
+            {
+                printf("[Dist] Error: Lost worker process %d\n", worker.pid);
+                return false;
+            }
+
+            // tile rows are packed back to back, anything else leaves the
+            // stream out of step
+            const STile     &tile = m_tiles[header.tileIndex];
+            const size_t    rowFloats = (tile.x1 - tile.x0) * 3;
+            if (header.nFloats != rowFloats * (tile.y1 - tile.y0))
+            {
+                printf("[Dist] Error: Worker process %d sent %u floats for a tile of %zu\n",
+                       worker.pid, header.nFloats, rowFloats * (tile.y1 - tile.y0));
+                return false;
+            }
+
+            tileData.resize(header.nFloats);
+            if (!_ReadAll(worker.fd, tileData.data(), header.nFloats * sizeof(float)))
+            {
+                printf("[Dist] Error: Lost worker process %d\n", worker.pid);
+                return false;
+            }
+
+            for (size_t h = tile.y0; h < tile.y1; h++)
+            {
+                float           *dst = &accum[(h * m_setting.render_w + tile.x0) * 3];
+                const float     *src = &tileData[(h - tile.y0) * rowFloats];
+                for (size_t k = 0; k < rowFloats; k++)
+                    dst[k] += src[k];
+            }
+
+            worker.inFlight--;
+            worker.nTiles++;
+            doneTiles++;
+
+            if (!sendTiles(worker))
+            {
+                printf("[Dist] Error: Lost worker process %d\n", worker.pid);
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+        printf("[Dist] Process %zu (pid %d): %u tiles\n", i, m_workers[i].pid, m_workers[i].nTiles);
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CTileCoordinator::_Spawn()
+{
+    // nothing buffered may be duplicated into the children
+    fflush(stdout);
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        int     fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            printf("[Dist] Error: socketpair failed\n");
+            return false;
+        }
+
+        int     pid = fork();
+        if (pid == 0)
+        {
+            // child: drop every coordinator-side socket, keep our own end
+            close(fds[0]);
+            for (size_t j = 0; j < i; j++)
+                close(m_workers[j].fd);
+
+            _WorkerMain(fds[1], m_setting, m_meshFile);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        if (pid < 0)
+        {
+            close(fds[0]);
+            printf("[Dist] Error: fork failed\n");
+            return false;
+        }
+
+        m_workers[i].pid = pid;
+        m_workers[i].fd = fds[0];
+    }
+
+    // wait until every worker has its scene loaded
+    for (SWorkerProcess &worker : m_workers)
+    {
+        STileResultHeader   ready;
+        if (!_ReadAll(worker.fd, &ready, sizeof(ready)) || ready.tileIndex != -1)
+        {
+            printf("[Dist] Error: Worker process %d failed to start\n", worker.pid);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CTileCoordinator::_Shutdown()
+{
+    for (SWorkerProcess &worker : m_workers)
+    {
+        if (worker.fd < 0)
+            continue;
+
+        STileRequest    quit = { -1, 0, 0 };
+        _WriteAll(worker.fd, &quit, sizeof(quit));
+        close(worker.fd);
+        worker.fd = -1;
+    }
+
+    for (SWorkerProcess &worker : m_workers)
+    {
+        if (worker.pid > 0)
+            waitpid(worker.pid, nullptr, 0);
+        worker.pid = -1;
+    }
+}
+
+//----------------------------------------------------
+
+void    CTileCoordinator::_WorkerMain(int fd, const SRenderSetting &setting, const std::string &meshFile)
+{
+    CRenderer   renderer;
+    renderer.SetRenderSetting(setting);
+    renderer.InitScene(meshFile.c_str());
+
+    std::vector<STile>          tiles;
+    std::vector<glm::u16vec2>   pixelOrder;
+    CRenderer::BuildTiles(setting, tiles, pixelOrder);
+
+    // tiles only touch their own pixels, so one shared scratch image is enough
+    std::vector<float>  pixmap(setting.render_w * setting.render_h * 3);
+    std::mutex          writeMutex;
+
+    STileResultHeader   ready = { -1, 0 };
+    if (!_WriteAll(fd, &ready, sizeof(ready)))
+        return;
+
+    // once the coordinator stops reading, queued tiles are dropped
+    CThreadPool         &pool = renderer.GetThreadPool();
+    std::atomic<bool>   isConnected(true);
+    STileRequest        request;
+    while (isConnected && _ReadAll(fd, &request, sizeof(request)) &&
+           request.tileIndex >= 0 && request.tileIndex < (int32_t)tiles.size())
+    {
+        pool.Submit([&, request] {
+            if (!isConnected)
+                return;
+
+            const STile     &tile = tiles[request.tileIndex];
+            const size_t    rowFloats = (tile.x1 - tile.x0) * 3;
+
+            for (size_t h = tile.y0; h < tile.y1; h++)
+                std::fill_n(&pixmap[(h * setting.render_w + tile.x0) * 3], rowFloats, 0.f);
+
+            renderer.RenderTile(renderer.GetCamera(), setting, pixelOrder, tile,
+                                request.sampleBegin, request.sampleEnd, pixmap.data());
+
+            std::vector<float>  tileData;
+            tileData.reserve(rowFloats * (tile.y1 - tile.y0));
+            for (size_t h = tile.y0; h < tile.y1; h++)
+            {
+                const float     *row = &pixmap[(h * setting.render_w + tile.x0) * 3];
+                tileData.insert(tileData.end(), row, row + rowFloats);
+            }
+
+            STileResultHeader   header = { request.tileIndex, (u_int32_t)tileData.size() };
+            std::lock_guard<std::mutex>     lock(writeMutex);
+            if (isConnected && (!_WriteAll(fd, &header, sizeof(header)) ||
+                                !_WriteAll(fd, tileData.data(), tileData.size() * sizeof(float))))
+                isConnected = false;
+        });
+    }
+
+    pool.Wait();
+    close(fd);
+}
+
+//----------------------------------------------------
+
+bool    CTileCoordinator::_ReadAll(int fd, void *data, size_t bytes)
+{
+    char    *ptr = (char*)data;
+    while (bytes > 0)
+    {
+        ssize_t     n = read(fd, ptr, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CTileCoordinator::_WriteAll(int fd, const void *data, size_t bytes)
+{
+    const char  *ptr = (const char*)data;
+    while (bytes > 0)
+    {
+        ssize_t     n = write(fd, ptr, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
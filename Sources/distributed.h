@@ -0,0 +1,71 @@
+#pragma once
+
+/*************************************************************************
+*
+*		distributed.h
+*
+*		Multi-process tile rendering. A local coordinator forks worker
+*		processes, each loading the scene itself, and hands out tiles
+*		over Unix-domain sockets. Results are written back into one
+*		accumulation buffer. Workers only see a socket, so remote
+*		workers can later be attached over TCP with the same protocol.
+*
+**************************************************************************/
+
+#include "renderer.h"
+
+#include <string>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CTileCoordinator
+{
+public:
+    // "setting.nThreads" is per worker process, 0 -> cores / nProcesses
+    CTileCoordinator(const SRenderSetting &setting, const std::string &meshFile, u_int32_t nProcesses);
+    ~CTileCoordinator();
+
+    // Render samples [sampleBegin, sampleEnd) of every tile into "accum"
+    // (render_w * render_h * 3 floats, summed, not averaged).
+    bool    Render(float *accum, u_int32_t sampleBegin, u_int32_t sampleEnd);
+
+private:
+    // wire format, both sides run the same binary so raw structs are fine
+    struct STileRequest
+    {
+        int32_t     tileIndex;      // -1 -> shut down
+        u_int32_t   sampleBegin, sampleEnd;
+    };
+    struct STileResultHeader
+    {
+        int32_t     tileIndex;      // -1 -> worker ready
+        u_int32_t   nFloats;
+    };
+
+    struct SWorkerProcess
+    {
+        int         pid = -1;
+        int         fd = -1;
+        int         inFlight = 0;
+        u_int32_t   nTiles = 0;     // rendered so far
+    };
+
+    bool        _Spawn();
+    void        _Shutdown();
+    static void _WorkerMain(int fd, const SRenderSetting &setting, const std::string &meshFile);
+
+    static bool _ReadAll(int fd, void *data, size_t bytes);
+    static bool _WriteAll(int fd, const void *data, size_t bytes);
+
+private:
+    SRenderSetting              m_setting;
+    std::string                 m_meshFile;
+    std::vector<STile>          m_tiles;
+    std::vector<glm::u16vec2>   m_pixelOrder;
+    std::vector<SWorkerProcess> m_workers;
+    bool                        m_isReady;
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
@@ -1,8 +1,14 @@
 #include "hittable_list.h"
+#include "mesh_cache.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>  // memcpy
+#include <unordered_map>
+
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
@@ -18,37 +24,50 @@ CHittableSphere::CHittableSphere(const glm::vec3 &origin, float radius, const st
 
 bool    CHittableSphere::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
 {
-    glm::vec3   oc = ray.m_origin - m_origin;
-    float       b = glm::dot(oc, ray.m_dir);
-    float       c = glm::dot(oc, oc) - m_radius * m_radius;
-    float       h = b * b - c;
-
-    if (h < 0.0)
+    float   t;
+    if (!Intersect(m_origin, m_radius, ray, t_min, t_max, t))
         return false;
 
-    hitRec.t = -b - glm::sqrt(h);
-    if (hitRec.t < t_min)
-        hitRec.t = -b + glm::sqrt(h);
-    if (hitRec.t < t_min || hitRec.t > t_max)
-        return false;
+    SetHitRec(ray, t, hitRec);
 
-    hitRec.p = ray.At(hitRec.t);
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittableSphere::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    float   t;
+    return Intersect(m_origin, m_radius, ray, t_min, t_max, t);
+}
+
+//----------------------------------------------------
+
+void    CHittableSphere::SetHitRec(const CRay &ray, float t, SHitRec &hitRec) const
+{
+    hitRec.t = t;
+    hitRec.p = ray.At(t);
     hitRec.n = (hitRec.p - m_origin) / m_radius;
     hitRec.setFaceNormal(ray);
     hitRec.p_material = m_material;
-
-    return true;
 }
 
 //----------------------------------------------------
 
 CHittableTriangle::CHittableTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const std::shared_ptr<IMaterial> &material)
-: m_v0(v0)
-, m_v1(v1)
-, m_v2(v2)
-, m_n(glm::normalize(glm::cross(v1 - v0, v0 - v2)))
 {
     m_material = material;
+    SetVertices(v0, v1, v2);
+}
+
+//----------------------------------------------------
+
+void    CHittableTriangle::SetVertices(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2)
+{
+    m_v0 = v0;
+    m_v1 = v1;
+    m_v2 = v2;
+    m_n = glm::normalize(glm::cross(v1 - v0, v0 - v2));
     m_aabb = CAABB(
         glm::vec3(glm::min(glm::min(v0.x, v1.x), v2.x),
                   glm::min(glm::min(v0.y, v1.y), v2.y),
@@ -63,31 +82,68 @@ CHittableTriangle::CHittableTriangle(const glm::vec3 &v0, const glm::vec3 &v1, c
 
 bool    CHittableTriangle::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
 {
-    glm::vec3   v1v0 = m_v1 - m_v0;
-    glm::vec3   v2v0 = m_v2 - m_v0;
-    glm::vec3   rov0 = ray.m_origin - m_v0;
-    glm::vec3   n = glm::cross( v1v0, v2v0 );
-    glm::vec3   q = glm::cross( rov0, ray.m_dir );
-    float       d = 1.0f / dot( ray.m_dir, n );
-    float       u = d * glm::dot( -q, v2v0 );
-    float       v = d * glm::dot(  q, v1v0 );
-    float       t = d * glm::dot( -n, rov0 );
-
-    if (u < 0.0f || v < 0.0f || (u + v) > 1.0f)
-        return false;
-    else if (t < t_min || t > t_max)
+    float   t;
+    if (!Intersect(m_v0, m_v1 - m_v0, m_v2 - m_v0, ray, t_min, t_max, t))
         return false;
 
     // there is a hit
+    SetHitRec(ray, t, hitRec);
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittableTriangle::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    float   t;
+    return Intersect(m_v0, m_v1 - m_v0, m_v2 - m_v0, ray, t_min, t_max, t);
+}
+
+//----------------------------------------------------
+
+void    CHittableTriangle::SetHitRec(const CRay &ray, float t, SHitRec &hitRec) const
+{
     hitRec.t = t;
     hitRec.p = ray.At(t);
     hitRec.n = m_n;
     hitRec.setFaceNormal(ray);
     hitRec.p_material = m_material;
+}
 
-    return true;
+//----------------------------------------------------
+
+void    CHittableTriangle::SplitBounds(int axis, float position, const CAABB &bounds, CAABB &left, CAABB &right) const
+{
+    // each side gets its vertices and the points where edges cross the plane
+    const glm::vec3     v[3] = { m_v0, m_v1, m_v2 };
+
+    left = right = CAABB();
+    for (int i = 0; i < 3; i++)
+    {
+        const glm::vec3     &a = v[i];
+        const glm::vec3     &b = v[(i + 1) % 3];
+
+        if (a[axis] <= position)
+            left = left + a;
+        if (a[axis] >= position)
+            right = right + a;
+
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position))
+        {
+            glm::vec3   p = glm::mix(a, b, (position - a[axis]) / (b[axis] - a[axis]));
+            p[axis] = position;
+            left = left + p;
+            right = right + p;
+        }
+    }
+
+    // only the part inside "bounds" was referenced
+    left = left - bounds;
+    right = right - bounds;
 }
 
+
 //----------------------------------------------------
 
 CHittableMesh::CHittableMesh(const glm::vec3 &origin, const std::shared_ptr<IMaterial> &material)
@@ -100,8 +156,21 @@ CHittableMesh::CHittableMesh(const glm::vec3 &origin, const std::shared_ptr<IMat
 
 //----------------------------------------------------
 
-bool    CHittableMesh::Load(const char* file)
+bool    CHittableMesh::Load(const char* file, CThreadPool *pool, CBVHAccel::EPartitionType partition, bool useCache, bool restructure)
 {
+    const std::string   cacheFile = std::string(file) + ".crcache";
+    SMeshCacheKey       cacheKey;
+    if (useCache)
+    {
+        cacheKey.fileHash = HashFile(file);
+        cacheKey.partition = partition;
+        cacheKey.maxHittablesInNode = CHittableList::s_maxHittablesInNode;
+        cacheKey.restructure = restructure;
+
+        if (cacheKey.fileHash != 0 && _LoadCache(cacheFile.c_str(), cacheKey, partition, restructure))
+            return true;
+    }
+
     // load obj
     tinyobj::attrib_t                   attrib;
     std::vector<tinyobj::shape_t>       shapes;
@@ -135,8 +204,19 @@ bool    CHittableMesh::Load(const char* file)
     printf("[Mesh] # of normals   : %lu\n", attrib.normals.size() / 3);
     printf("[Mesh] # of faces     : %lu\n", shapes[0].mesh.indices.size() / 3);
 
-    std::vector<glm::vec3>  uniqueVertices;
-    std::vector<uint32_t>   uniqueIndices;
+    // welds equal positions, hashing "v + 0.f" folds -0.f into 0.f as operator== does
+    struct SVertexHash
+    {
+        size_t  operator()(const glm::vec3 &v) const
+        {
+            glm::vec3   p = v + 0.f;
+            u_int32_t   bits[3];
+            memcpy(bits, &p, sizeof(bits));
+            return ((size_t)bits[0] * 73856093u) ^ ((size_t)bits[1] * 19349663u) ^ ((size_t)bits[2] * 83492791u);
+        }
+    };
+    std::unordered_map<glm::vec3, uint32_t, SVertexHash>    uniqueVertices;
+    uniqueVertices.reserve(attrib.vertices.size() / 3);
 
     // copy vertices and indices
     for (const auto& shape : shapes) {
@@ -151,33 +231,53 @@ bool    CHittableMesh::Load(const char* file)
                 static_cast<float>(attrib.vertices[3 * index.vertex_index + 2])
             );
 
-            auto    it = std::find(uniqueVertices.begin(), uniqueVertices.end(), v);
-            size_t  indicesIdx;
             // only keep unique vertices
-            if (it == uniqueVertices.end())
-            {
-                uniqueVertices.push_back(v);
-                uniqueIndices.push_back(static_cast<uint32_t>(m_vertices.size()));
+            auto    it = uniqueVertices.emplace(v, static_cast<uint32_t>(m_vertices.size()));
+            if (it.second)
                 m_vertices.push_back(v);
 
-                indicesIdx = uniqueVertices.size() - 1;
-            }
-            else
-                indicesIdx = it - uniqueVertices.begin();
-
             // indices
-            m_indices.push_back(uniqueIndices[indicesIdx]);
+            m_indices.push_back(it.first->second);
         }
     }
 
+    std::vector<std::shared_ptr<IHittable>>     triangles;
+    _CreateTriangles(triangles);
+    for (const auto &triangle : triangles)
+        m_triangles->Add(triangle);
+
+    m_triangles->BuildBVHTree(pool, partition, restructure);
+
+    printf("[Mesh] Finished loading obj \"%s\"\n", file);
+
+    if (useCache && cacheKey.fileHash != 0)
+    {
+        const auto  &accel = m_triangles->GetBVHAccel();
+        if (SaveMeshCache(cacheFile.c_str(), cacheKey, m_vertices, m_indices, accel->GetHittableOrder(),
+                          accel->GetNodes(), accel->GetNodeCount(), CBVHAccel::GetNodeSize(), accel->GetBuildSAHCost()))
+            printf("[Cache] Wrote \"%s\"\n", cacheFile.c_str());
+    }
+
+    m_isMeshLoaded = true;
+
+    return m_isMeshLoaded;
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::_CreateTriangles(std::vector<std::shared_ptr<IHittable>> &triangles)
+{
     // precompute triangle data
+    triangles.reserve(m_indices.size() / 3);
+    m_faces.reserve(m_indices.size() / 3);
     for (size_t i = 0; i < m_indices.size() / 3; i++)
     {
         auto triangle = std::make_shared<CHittableTriangle>(m_vertices[m_indices[i * 3 + 0]],
                                                             m_vertices[m_indices[i * 3 + 1]],
                                                             m_vertices[m_indices[i * 3 + 2]],
                                                             m_material);
-        m_triangles->Add(triangle);
+        triangles.push_back(triangle);
+        m_faces.push_back(triangle.get());
 
         // AABB
         m_aabb.pMin.x = glm::min(m_aabb.pMin.x, triangle->m_aabb.pMin.x);
@@ -187,10 +287,49 @@ bool    CHittableMesh::Load(const char* file)
         m_aabb.pMax.y = glm::max(m_aabb.pMax.y, triangle->m_aabb.pMax.y);
         m_aabb.pMax.z = glm::max(m_aabb.pMax.z, triangle->m_aabb.pMax.z);
     }
+}
 
-    m_triangles->BuildBVHTree();
+//----------------------------------------------------
 
-    printf("[Mesh] Finished loading obj \"%s\"\n", file);
+bool    CHittableMesh::_LoadCache(const char* cacheFile, const SMeshCacheKey &key, CBVHAccel::EPartitionType partition, bool restructure)
+{
+    auto        start = std::chrono::steady_clock::now();
+    SMeshCache  cache;
+    if (!LoadMeshCache(cacheFile, key, CBVHAccel::GetNodeSize(), cache))
+        return false;
+
+    // the header matched, still never index out of the mapped arrays
+    const u_int32_t nFaces = cache.nIndices / 3;
+    bool            isValid = cache.nIndices % 3 == 0 && cache.nHittables >= nFaces;
+    for (u_int32_t i = 0; isValid && i < cache.nIndices; i++)
+        isValid = cache.indices[i] < cache.nVertices;
+    for (u_int32_t i = 0; isValid && i < cache.nHittables; i++)
+        isValid = cache.hittableOrder[i] < nFaces;
+    isValid = isValid && CBVHAccel::IsValidTree(cache.nodes, cache.nNodes, cache.nHittables);
+    if (!isValid)
+    {
+        printf("[Cache] \"%s\" is corrupt, ignoring it\n", cacheFile);
+        return false;
+    }
+
+    m_vertices.assign(cache.vertices, cache.vertices + cache.nVertices);
+    m_indices.assign(cache.indices, cache.indices + cache.nIndices);
+
+    std::vector<std::shared_ptr<IHittable>>     triangles;
+    _CreateTriangles(triangles);
+
+    // the tree references the triangles in leaf order, spatial splits repeat some
+    std::vector<std::shared_ptr<IHittable>>     orderedTriangles(cache.nHittables);
+    for (u_int32_t i = 0; i < cache.nHittables; i++)
+        orderedTriangles[i] = triangles[cache.hittableOrder[i]];
+
+    // nodes stay in the mapped file
+    m_triangles->SetBVHAccel(std::make_shared<CBVHAccel>(orderedTriangles, cache.hittableOrder,
+                                                         CHittableList::s_maxHittablesInNode, partition, restructure,
+                                                         cache.nodes, cache.nNodes, cache.sahCost, cache.file));
+
+    float   ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("[Cache] Loaded %u faces and %u bvh nodes from \"%s\" in %.2f ms\n", nFaces, cache.nNodes, cacheFile, ms);
 
     m_isMeshLoaded = true;
 
@@ -199,6 +338,28 @@ bool    CHittableMesh::Load(const char* file)
 
 //----------------------------------------------------
 
+bool    CHittableMesh::SetVertices(const std::vector<glm::vec3> &vertices, CThreadPool *pool)
+{
+    if (!m_isMeshLoaded || vertices.size() != m_vertices.size())
+        return false;
+
+    m_vertices = vertices;
+    m_aabb = CAABB();
+    for (size_t i = 0; i < m_faces.size(); i++)
+    {
+        m_faces[i]->SetVertices(m_vertices[m_indices[i * 3 + 0]],
+                                m_vertices[m_indices[i * 3 + 1]],
+                                m_vertices[m_indices[i * 3 + 2]]);
+        m_aabb = m_aabb + m_faces[i]->m_aabb;
+    }
+
+    m_triangles->RefitBVHTree(pool);
+
+    return true;
+}
+
+//----------------------------------------------------
+
 bool    CHittableMesh::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
 {
     if (!m_isMeshLoaded)
@@ -212,4 +373,105 @@ bool    CHittableMesh::Hit(const CRay &ray, float t_min, float t_max, SHitRec &h
 
 //----------------------------------------------------
 
+bool    CHittableMesh::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    return m_isMeshLoaded && m_triangles->Occluded(ray, t_min, t_max);
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::ReplicateNuma(u_int32_t nNodes)
+{
+    m_triangles->ReplicateNuma(nNodes);
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::CompressBVH()
+{
+    m_triangles->CompressBVH();
+}
+
+//----------------------------------------------------
+
+CHittableInstance::CHittableInstance(const std::shared_ptr<IHittable> &object, const glm::mat4 &transform,
+                                     const std::shared_ptr<IMaterial> &material)
+: m_object(object)
+, m_transform(transform)
+, m_invTransform(glm::inverse(transform))
+, m_normalTransform(glm::transpose(glm::inverse(glm::mat3(transform))))
+{
+    m_material = material;
+
+    UpdateBounds();
+}
+
+//----------------------------------------------------
+
+bool    CHittableInstance::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    float   scale;
+    CRay    objRay = _ToObject(ray, scale);
+    if (!m_object->Hit(objRay, t_min * scale, t_max * scale, hitRec))
+        return false;
+
+    // the object already faced the normal against the ray, the inverse
+    // transpose keeps that side
+    hitRec.t /= scale;
+    hitRec.p = ray.At(hitRec.t);
+    hitRec.n = glm::normalize(m_normalTransform * hitRec.n);
+    if (m_material != nullptr)
+        hitRec.p_material = m_material;
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittableInstance::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    float   scale;
+    CRay    objRay = _ToObject(ray, scale);
+    return m_object->Occluded(objRay, t_min * scale, t_max * scale);
+}
+
+//----------------------------------------------------
+
+void    CHittableInstance::ReplicateNuma(u_int32_t nNodes)
+{
+    m_object->ReplicateNuma(nNodes);
+}
+
+//----------------------------------------------------
+
+void    CHittableInstance::CompressBVH()
+{
+    m_object->CompressBVH();
+}
+
+//----------------------------------------------------
+
+void    CHittableInstance::UpdateBounds()
+{
+    m_object->UpdateBounds();
+
+    // world bounds of the transformed object box
+    m_aabb = CAABB();
+    for (int corner = 0; corner < 8; corner++)
+        m_aabb = m_aabb + glm::vec3(m_transform * glm::vec4(m_object->m_aabb.Corner(corner), 1.f));
+}
+
+//----------------------------------------------------
+
+CRay    CHittableInstance::_ToObject(const CRay &ray, float &scale) const
+{
+    // CRay normalizes its direction, hittables rely on that
+    glm::vec3   dir = glm::vec3(m_invTransform * glm::vec4(ray.m_dir, 0.f));
+    scale = glm::length(dir);
+
+    return CRay(glm::vec3(m_invTransform * glm::vec4(ray.m_origin, 1.f)), dir);
+}
+
+//----------------------------------------------------
+
 _CR_NAMESPACE_END
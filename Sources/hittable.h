@@ -3,12 +3,15 @@
 #include "common.h"
 #include "ray.h"
 #include "aabb.h"
+#include "bvh.h"
 
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
 class IMaterial;
 class CHittableList;
+class CThreadPool;
+struct SMeshCacheKey;
 
 //----------------------------------------------------
 
@@ -33,6 +36,25 @@ class IHittable
 {
 public:
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const = 0;
+    // Any intersection in [t_min, t_max], for shadow and visibility rays.
+    // Implementations stop at the first one found and skip the hit record.
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const { SHitRec hitRec; return Hit(ray, t_min, t_max, hitRec); }
+    // copy read-only acceleration data to every NUMA node, see CBVHAccel
+    virtual void    ReplicateNuma(u_int32_t /*nNodes*/) {}
+    // quantize the bvh-tree nodes, see CBVHAccel::Compress()
+    virtual void    CompressBVH() {}
+    // recompute "m_aabb" where it derives from shared data that may have
+    // changed, CBVHAccel::Refit() calls this before reading the bounds
+    virtual void    UpdateBounds() {}
+    // Split the part of this hittable inside "bounds" by the plane at
+    // "position" on "axis", for spatial split bvh-trees. The default cuts the
+    // box itself, primitives that know their shape clip tighter.
+    virtual void    SplitBounds(int axis, float position, const CAABB &bounds, CAABB &left, CAABB &right) const
+    {
+        left = right = bounds;
+        left.pMax[axis] = std::min(bounds.pMax[axis], position);
+        right.pMin[axis] = std::max(bounds.pMin[axis], position);
+    }
 
 public:
     std::shared_ptr<IMaterial>  m_material;
@@ -47,6 +69,27 @@ public:
     CHittableSphere(const glm::vec3 &origin, float radius, const std::shared_ptr<IMaterial> &material);
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+
+    // The intersection and the hit record separately, so CBVHAccel can test
+    // its packed copies of the spheres and fill the record of the closest.
+    static inline bool  Intersect(const glm::vec3 &origin, float radius, const CRay &ray, float t_min, float t_max, float &t)
+    {
+        glm::vec3   oc = ray.m_origin - origin;
+        float       b = glm::dot(oc, ray.m_dir);
+        float       c = glm::dot(oc, oc) - radius * radius;
+        float       h = b * b - c;
+
+        if (h < 0.0)
+            return false;
+
+        t = -b - glm::sqrt(h);
+        if (t < t_min)
+            t = -b + glm::sqrt(h);
+
+        return t >= t_min && t <= t_max;
+    }
+    void            SetHitRec(const CRay &ray, float t, SHitRec &hitRec) const;
 
 public:
     glm::vec3   m_origin;
@@ -61,6 +104,29 @@ public:
     CHittableTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const std::shared_ptr<IMaterial> &material);
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual void    SplitBounds(int axis, float position, const CAABB &bounds, CAABB &left, CAABB &right) const override;
+    // move the triangle, the bvh-tree holding it needs a refit afterwards
+    void            SetVertices(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2);
+
+    // see CHittableSphere::Intersect(), "edge1" is v1 - v0 and "edge2" v2 - v0
+    static inline bool  Intersect(const glm::vec3 &v0, const glm::vec3 &edge1, const glm::vec3 &edge2,
+                                  const CRay &ray, float t_min, float t_max, float &t)
+    {
+        glm::vec3   rov0 = ray.m_origin - v0;
+        glm::vec3   n = glm::cross( edge1, edge2 );
+        glm::vec3   q = glm::cross( rov0, ray.m_dir );
+        float       d = 1.0f / dot( ray.m_dir, n );
+        float       u = d * glm::dot( -q, edge2 );
+        float       v = d * glm::dot(  q, edge1 );
+        t = d * glm::dot( -n, rov0 );
+
+        if (u < 0.0f || v < 0.0f || (u + v) > 1.0f)
+            return false;
+
+        return t >= t_min && t <= t_max;
+    }
+    void            SetHitRec(const CRay &ray, float t, SHitRec &hitRec) const;
 
 public:
     glm::vec3   m_v0, m_v1, m_v2;
@@ -75,19 +141,69 @@ public:
     CHittableMesh(const glm::vec3 &origin, const std::shared_ptr<IMaterial> &material);
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
-    bool            Load(const char* file);
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual void    ReplicateNuma(u_int32_t nNodes) override;
+    virtual void    CompressBVH() override;
+    // "pool" (optional) parallelizes the bvh-tree construction, "partition"
+    // trades build time against traversal speed (LBVH builds fastest).
+    // "useCache" loads the mesh and its tree from "<file>.crcache" when it
+    // matches, otherwise writes it after the build, see mesh_cache.h.
+    // "restructure" optimizes the built tree further for static scenes.
+    bool            Load(const char* file, CThreadPool *pool = nullptr, CBVHAccel::EPartitionType partition = CBVHAccel::SAH,
+                         bool useCache = false, bool restructure = false);
+    // Deform the loaded mesh, "vertices" replaces "m_vertices" with the same
+    // count and indexing. The bvh-tree is refit, or rebuilt if it degraded.
+    // A bvh-tree holding this mesh needs a refit afterwards as well.
+    bool            SetVertices(const std::vector<glm::vec3> &vertices, CThreadPool *pool = nullptr);
+    const std::vector<glm::vec3>&   GetVertices() const { return m_vertices; }
 
 public:
     glm::vec3                       m_origin;
 
 private:
+    // triangles of "m_indices" into "m_faces" and "triangles", grows "m_aabb"
+    void            _CreateTriangles(std::vector<std::shared_ptr<IHittable>> &triangles);
+    bool            _LoadCache(const char* cacheFile, const SMeshCacheKey &key, CBVHAccel::EPartitionType partition, bool restructure);
+
     // mesh data
     std::vector<glm::vec3>          m_vertices;
     std::vector<uint32_t>           m_indices;
     std::shared_ptr<CHittableList>  m_triangles;
+    std::vector<CHittableTriangle*> m_faces;        // "m_triangles" in "m_indices" order
 
     bool                            m_isMeshLoaded;
 };
 
+//----------------------------------------------------
+
+// Places a shared hittable, e.g. a mesh with its bvh-tree, with an affine
+// transform. Rays are moved into object space instead of the geometry, so any
+// number of instances cost one copy of the mesh. A scene list over instances
+// is the top level of a two-level bvh-tree, the shared meshes the bottom one.
+class CHittableInstance : public IHittable
+{
+public:
+    // "material" (optional) replaces the materials of the object
+    CHittableInstance(const std::shared_ptr<IHittable> &object, const glm::mat4 &transform,
+                      const std::shared_ptr<IMaterial> &material = nullptr);
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual void    ReplicateNuma(u_int32_t nNodes) override;
+    virtual void    CompressBVH() override;
+    // the object may have been deformed, e.g. CHittableMesh::SetVertices()
+    virtual void    UpdateBounds() override;
+
+private:
+    // object space ray, "scale" converts world distances to object space
+    CRay            _ToObject(const CRay &ray, float &scale) const;
+
+public:
+    std::shared_ptr<IHittable>  m_object;
+    glm::mat4                   m_transform;
+    glm::mat4                   m_invTransform;
+    glm::mat3                   m_normalTransform;      // inverse transpose
+};
+
 //----------------------------------------------------
 _CR_NAMESPACE_END
@@ -39,12 +39,57 @@ bool    CHittableList::Hit(const CRay &ray, float t_min, float t_max, SHitRec &h
 
 //----------------------------------------------------
 
-bool    CHittableList::BuildBVHTree()
+bool    CHittableList::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    // BVH-Acceleration
+    if (!m_bvhAccel->IsEmpty())
+        return m_bvhAccel->Occluded(ray, t_min, t_max);
+
+    // Brute-Force, any hit will do
+    for (const auto &obj : m_hittables) {
+        if (obj->Occluded(ray, t_min, t_max))
+            return true;
+    }
+
+    return false;
+}
+
+//----------------------------------------------------
+
+void    CHittableList::ReplicateNuma(u_int32_t nNodes)
+{
+    if (m_bvhAccel != nullptr && !m_bvhAccel->IsEmpty())
+    {
+        m_bvhAccel->ReplicateNuma(nNodes);
+        return;
+    }
+
+    for (const auto &obj : m_hittables)
+        obj->ReplicateNuma(nNodes);
+}
+
+//----------------------------------------------------
+
+void    CHittableList::CompressBVH()
+{
+    if (m_bvhAccel != nullptr && !m_bvhAccel->IsEmpty())
+    {
+        m_bvhAccel->Compress();
+        return;
+    }
+
+    for (const auto &obj : m_hittables)
+        obj->CompressBVH();
+}
+
+//----------------------------------------------------
+
+bool    CHittableList::BuildBVHTree(CThreadPool *pool, CBVHAccel::EPartitionType partition, bool restructure)
 {
     // FIXME: not calling BuildBVHTree() will cause crash, because "m_bvhAccel" is not
     // instanced at all. Perhaps create a "CBVHAccel::Construct" function that separtes
     // the build process from instantiation.
-    m_bvhAccel = std::make_shared<CBVHAccel>(CBVHAccel(m_hittables, 32, CBVHAccel::SAH));
+    m_bvhAccel = std::make_shared<CBVHAccel>(m_hittables, s_maxHittablesInNode, partition, pool, restructure);
 
     // clear local hittable list which now is a dublicate data with the one in bvh-tree.
     if (!m_bvhAccel->IsEmpty())
@@ -53,5 +98,24 @@ bool    CHittableList::BuildBVHTree()
     return true;
 }
 
+//----------------------------------------------------
+
+void    CHittableList::SetBVHAccel(const std::shared_ptr<CBVHAccel> &bvhAccel)
+{
+    m_bvhAccel = bvhAccel;
+    if (!m_bvhAccel->IsEmpty())
+        m_hittables.clear();
+}
+
+//----------------------------------------------------
+
+bool    CHittableList::RefitBVHTree(CThreadPool *pool)
+{
+    if (m_bvhAccel == nullptr)
+        return false;
+
+    return m_bvhAccel->Refit(pool);
+}
+
 //----------------------------------------------------
 _CR_NAMESPACE_END
@@ -5,7 +5,7 @@
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
-class CBVHAccel;
+class CThreadPool;
 
 //----------------------------------------------------
 
@@ -16,10 +16,25 @@ public:
     inline void    Clear();
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual void    ReplicateNuma(u_int32_t nNodes) override;
+    virtual void    CompressBVH() override;
 
     // Construct bvh-tree from the loaded hittables. Call this once all the
-    // hittables are loaded in "m_hittables".
-    bool            BuildBVHTree();
+    // hittables are loaded in "m_hittables". A "pool" builds it in parallel,
+    // "restructure" optimizes the tree further, see CBVHAccel.
+    bool            BuildBVHTree(CThreadPool *pool = nullptr, CBVHAccel::EPartitionType partition = CBVHAccel::SAH,
+                                 bool restructure = false);
+    // Update the bvh-tree after hittables moved, see CBVHAccel::Refit().
+    // Returns true if the tree had to be rebuilt.
+    bool            RefitBVHTree(CThreadPool *pool = nullptr);
+
+    // the bvh-tree, or replace it with one over the same hittables (e.g. from
+    // a cache). Like BuildBVHTree() this drops the local hittable list.
+    const std::shared_ptr<CBVHAccel>&   GetBVHAccel() const { return m_bvhAccel; }
+    void            SetBVHAccel(const std::shared_ptr<CBVHAccel> &bvhAccel);
+
+    static constexpr int    s_maxHittablesInNode = 32;  // bvh-tree leaf size
 
 private:
     // Hittable list will first attempt to use "m_bvhAccel" is available, 
@@ -0,0 +1,214 @@
+#include "image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+
+#include <cstring>  // memcmp
+#include <fstream>
+#include <string>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+bool    SaveImage(const char* filename, const float* pixmap, u_int32_t img_w, u_int32_t img_h)
+{
+    // remap pixmap to 8 bits
+    std::vector<unsigned char>  pixmap8bits(img_w * img_h * 3);
+    for (size_t i = 0; i < pixmap8bits.size(); ++i)
+        pixmap8bits[i] = (unsigned char)(glm::clamp(pixmap[i], 0.f, 1.f) * 255.f);
+
+    std::string     name(filename);
+    std::string     ext = name.substr(name.find_last_of('.') + 1);
+    for (char &c : ext)
+        c = tolower(c);
+
+    stbi_flip_vertically_on_write(true);
+
+    int success = 0;
+    if (ext == "png")
+        success = stbi_write_png(filename, img_w, img_h, 3, pixmap8bits.data(), img_w * 3);
+    else if (ext == "bmp")
+        success = stbi_write_bmp(filename, img_w, img_h, 3, pixmap8bits.data());
+    else if (ext == "tga")
+        success = stbi_write_tga(filename, img_w, img_h, 3, pixmap8bits.data());
+    else if (ext == "jpg" || ext == "jpeg")
+        success = stbi_write_jpg(filename, img_w, img_h, 3, pixmap8bits.data(), 100);
+    else
+        printf("[Image] Error: Unsupported image format \"%s\"\n", filename);
+
+    return success != 0;
+}
+
+//----------------------------------------------------
+
+// file layout, little endian on every host so partial renders from
+// different machines merge
+struct SAccumulationHeader
+{
+    char        magic[4];       // "CRAC"
+    u_int32_t   version;
+    u_int32_t   width;
+    u_int32_t   height;
+};
+
+static const char       s_accMagic[4] = { 'C', 'R', 'A', 'C' };
+static const u_int32_t  s_accVersion = 1;
+
+//----------------------------------------------------
+
+static bool     _IsLittleEndian()
+{
+    const u_int32_t     one = 1;
+    return *(const uint8_t*)&one == 1;
+}
+
+//----------------------------------------------------
+
+// convert 4 byte words between host and file order, in place (a no-op on
+// little endian hosts, its own inverse otherwise)
+static void     _SwapWords(void *data, size_t nWords)
+{
+    if (_IsLittleEndian())
+        return;
+
+    uint8_t     *bytes = (uint8_t*)data;
+    for (size_t i = 0; i < nWords; i++, bytes += 4)
+    {
+        std::swap(bytes[0], bytes[3]);
+        std::swap(bytes[1], bytes[2]);
+    }
+}
+
+//----------------------------------------------------
+
+bool    SaveAccumulation(const char* filename, const SAccumulation &acc)
+{
+    std::ofstream   file(filename, std::ios::binary);
+    if (!file)
+    {
+        printf("[Image] Error: Cannot open \"%s\" for writing\n", filename);
+        return false;
+    }
+
+    SAccumulationHeader     header;
+    memcpy(header.magic, s_accMagic, sizeof(header.magic));
+    header.version = s_accVersion;
+    header.width = acc.width;
+    header.height = acc.height;
+    _SwapWords(&header.version, 3);
+    file.write((const char*)&header, sizeof(header));
+
+    if (_IsLittleEndian())
+    {
+        file.write((const char*)acc.accum.data(), acc.accum.size() * sizeof(float));
+        file.write((const char*)acc.counts.data(), acc.counts.size() * sizeof(u_int32_t));
+    }
+    else
+    {
+        std::vector<float>      accum = acc.accum;
+        std::vector<u_int32_t>  counts = acc.counts;
+        _SwapWords(accum.data(), accum.size());
+        _SwapWords(counts.data(), counts.size());
+        file.write((const char*)accum.data(), accum.size() * sizeof(float));
+        file.write((const char*)counts.data(), counts.size() * sizeof(u_int32_t));
+    }
+
+    return file.good();
+}
+
+//----------------------------------------------------
+
+bool    LoadAccumulation(const char* filename, SAccumulation &acc)
+{
+    std::ifstream   file(filename, std::ios::binary);
+    if (!file)
+    {
+        printf("[Image] Error: Cannot open \"%s\"\n", filename);
+        return false;
+    }
+
+    SAccumulationHeader     header;
+    file.read((char*)&header, sizeof(header));
+    _SwapWords(&header.version, 3);
+    if (!file || memcmp(header.magic, s_accMagic, sizeof(s_accMagic)) != 0 || header.version != s_accVersion)
+    {
+        printf("[Image] Error: \"%s\" is not a version %u accumulation file\n", filename, s_accVersion);
+        return false;
+    }
+
+    // the payload has to be there before the header sizes any buffer, a
+    // corrupt header would otherwise ask for gigabytes
+    const std::streampos    payloadBegin = file.tellg();
+    file.seekg(0, std::ios::end);
+    const uint64_t          fileBytes = file.tellg() - payloadBegin;
+    file.seekg(payloadBegin);
+    const uint64_t          payloadBytes = (uint64_t)header.width * header.height * (3 * sizeof(float) + sizeof(u_int32_t));
+    if (header.width == 0 || header.height == 0)
+    {
+        printf("[Image] Error: \"%s\" has an empty %ux%u image\n", filename, header.width, header.height);
+        return false;
+    }
+    if (!file || fileBytes < payloadBytes)
+    {
+        printf("[Image] Error: \"%s\" is truncated\n", filename);
+        return false;
+    }
+
+    acc.width = header.width;
+    acc.height = header.height;
+    acc.accum.resize((size_t)acc.width * acc.height * 3);
+    acc.counts.resize((size_t)acc.width * acc.height);
+    file.read((char*)acc.accum.data(), acc.accum.size() * sizeof(float));
+    file.read((char*)acc.counts.data(), acc.counts.size() * sizeof(u_int32_t));
+
+    if (!file)
+    {
+        printf("[Image] Error: \"%s\" is truncated\n", filename);
+        return false;
+    }
+    _SwapWords(acc.accum.data(), acc.accum.size());
+    _SwapWords(acc.counts.data(), acc.counts.size());
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    MergeAccumulation(SAccumulation &acc, const SAccumulation &other)
+{
+    if (acc.accum.empty())
+    {
+        acc = other;
+        return true;
+    }
+
+    if (acc.width != other.width || acc.height != other.height)
+    {
+        printf("[Image] Error: Cannot merge %ux%u into %ux%u\n", other.width, other.height, acc.width, acc.height);
+        return false;
+    }
+
+    for (size_t i = 0; i < acc.accum.size(); i++)
+        acc.accum[i] += other.accum[i];
+    for (size_t i = 0; i < acc.counts.size(); i++)
+        acc.counts[i] += other.counts[i];
+
+    return true;
+}
+
+//----------------------------------------------------
+
+void    ResolveAccumulation(const SAccumulation &acc, float* outMap)
+{
+    for (size_t i = 0; i < acc.counts.size(); i++)
+    {
+        float   scale = acc.counts[i] > 0 ? 1.f / acc.counts[i] : 0.f;
+
+        // gamma correction
+        for (size_t c = 0; c < 3; c++)
+            outMap[i * 3 + c] = glm::sqrt(acc.accum[i * 3 + c] * scale);
+    }
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
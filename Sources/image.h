@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Write a display-ready RGB float image (bottom row first, as rendered) to
+// disk. The format follows the file extension: .png, .jpg, .bmp or .tga.
+bool    SaveImage(const char* filename, const float* pixmap, u_int32_t img_w, u_int32_t img_h);
+
+//----------------------------------------------------
+
+// Raw, unnormalized radiance sums plus the number of samples behind every
+// pixel. Partial renders of the same frame (e.g. disjoint sample ranges on
+// different machines) add up to the same result as one full render.
+struct SAccumulation
+{
+    u_int32_t               width = 0, height = 0;
+    std::vector<float>      accum;      // width * height * 3
+    std::vector<u_int32_t>  counts;     // width * height
+};
+
+// ".cracc" files: versioned header followed by "accum" and "counts", little
+// endian whatever the host
+bool    SaveAccumulation(const char* filename, const SAccumulation &acc);
+bool    LoadAccumulation(const char* filename, SAccumulation &acc);
+
+// sum "other" into "acc", both must have the same resolution
+bool    MergeAccumulation(SAccumulation &acc, const SAccumulation &other);
+// average by per-pixel sample count and gamma correct, as SaveImage expects
+void    ResolveAccumulation(const SAccumulation &acc, float* outMap);
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
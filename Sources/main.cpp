@@ -1,12 +1,11 @@
 #include "GLFW/glfw3.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb/stb_image_write.h"
 
 #include "renderer.h"
+#include "image.h"
 
 //----------------------------------------------------
 
-float* pixmap = nullptr;
+const float*        pixmap = nullptr;   // latest frame, owned by the renderer
 cr::SRenderSetting  renderSetting;
 
 //----------------------------------------------------
@@ -15,15 +14,10 @@ void saveJpeg(u_int32_t img_w, u_int32_t img_h)
 {
     const char* filename = "MyRender.jpg";
 
-    // remap pixmap to 8 bits
-    unsigned char pixmap8bits[img_w * img_h * 3];
-    for (size_t i = 0; i < img_w * img_h * 3; ++i)
-        pixmap8bits[i] = pixmap[i] * 255.f;
+    if (pixmap == nullptr)
+        return;
 
-    stbi_flip_vertically_on_write(true);
-    int success = stbi_write_jpg(filename, img_w, img_h, 3, pixmap8bits, 100);
-
-    if (success)
+    if (cr::SaveImage(filename, pixmap, img_w, img_h))
         std::cout << "Image saved: " << filename << std::endl;
     else
         std::cout << "Error while saving image: " << filename << std::endl;
@@ -66,11 +60,15 @@ int main(void)
     renderSetting.nMaxDepth = 10;
     renderSetting.nSamplesW = glm::sqrt(renderSetting.nSamples);
     renderSetting.nSamplesOffset = 0.5f / renderSetting.nSamplesW;
+    renderSetting.frameBudgetMs = 16.f;     // publish a frame roughly every 60Hz
 
     renderer.SetRenderSetting(renderSetting);
     renderer.InitScene();
     // renderer.FullRender();
 
+    // path tracing runs on its own thread, the loop below only presents
+    renderer.StartRenderThread();
+
     while (!glfwWindowShouldClose(window))
     {
         int fbuffer_w, fbuffer_h;
@@ -85,9 +83,7 @@ int main(void)
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
 
-        if (!renderer.IsFinished())
-            renderer.ProgressiveRender();
-        renderer.GetLastRender(pixmap);
+        pixmap = renderer.AcquireFrame();
 
         glClear(GL_COLOR_BUFFER_BIT);
         glRasterPos2i(0, 0);
@@ -98,9 +94,8 @@ int main(void)
         glfwPollEvents();
     }
 
+    renderer.StopRenderThread();
     glfwTerminate();
-    
-    delete[] pixmap;
 
     return 0;
 }
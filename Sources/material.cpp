@@ -1,7 +1,6 @@
 #include "hittable.h"
 #include "material.h"
-
-#include "glm/gtc/random.hpp"
+#include "random.h"
 
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
@@ -20,9 +19,9 @@ CMaterialLambertian::CMaterialLambertian(std::unique_ptr<ITexture>& texture)
 
 //----------------------------------------------------
 
-bool    CMaterialLambertian::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const
+bool    CMaterialLambertian::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const
 {
-    cr::CRay    diffuseRay = cr::CRay(hitRec.p, hitRec.n + glm::vec3(glm::sphericalRand(1.0)));
+    cr::CRay    diffuseRay = cr::CRay(hitRec.p, hitRec.n + rng.NextUnitVector());
     attenuation = m_albedo->Eval(0, 0, hitRec.p);
     scattered = diffuseRay;
 
@@ -43,10 +42,10 @@ CMaterialMetal::CMaterialMetal(const glm::vec3 &color, float glossiness)
 
 //----------------------------------------------------
 
-bool    CMaterialMetal::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const
+bool    CMaterialMetal::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const
 {
     glm::vec3   reflectedDir = glm::reflect(ray.m_dir, hitRec.n);
-    cr::CRay    reflectedRay = cr::CRay(hitRec.p, reflectedDir + m_glossiness * glm::vec3(glm::sphericalRand(1.0f)));
+    cr::CRay    reflectedRay = cr::CRay(hitRec.p, reflectedDir + m_glossiness * rng.NextUnitVector());
     attenuation = m_albedo;
     scattered = reflectedRay;
 
@@ -63,7 +62,7 @@ CMaterialGlass::CMaterialGlass(float refractiveIndex, float glossiness)
 
 //----------------------------------------------------
 
-bool    CMaterialGlass::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const
+bool    CMaterialGlass::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const
 {
     float       refractiveRatio = hitRec.frontFace ? (1.0f / m_refractiveIndex) : m_refractiveIndex;
     float       cosTheta = fmin(glm::dot(-ray.m_dir, hitRec.n), 1.0);
@@ -72,10 +71,11 @@ bool    CMaterialGlass::Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec
     bool        canRefract = (refractiveRatio * sinTheta <= 1.0);
     glm::vec3   outDir;
 
-    if (canRefract || (_Reflectance(cosTheta, refractiveRatio) > (float)rand() / RAND_MAX))
+    // total internal reflection has no refracted direction (glm returns zero)
+    if (!canRefract || (_Reflectance(cosTheta, refractiveRatio) > rng.NextFloat()))
+        outDir = glm::reflect(ray.m_dir, hitRec.n);
+    else
         outDir = glm::refract(ray.m_dir, hitRec.n, refractiveRatio);
-    else    // reflect
-        outDir =  glm::reflect(ray.m_dir, hitRec.n);
 
     attenuation = glm::vec3(1.f);
     scattered = CRay(hitRec.p, outDir);
@@ -10,11 +10,12 @@ _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
 struct SHitRec;
+class CRandom;
 
 class IMaterial
 {
 public:
-    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const = 0;
+    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const = 0;
 };
 
 //----------------------------------------------------
@@ -25,7 +26,7 @@ public:
     CMaterialLambertian(const glm::vec3& color);
     CMaterialLambertian(std::unique_ptr<ITexture>& texture);
 
-    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const override;
+    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const override;
 
 public:
     std::unique_ptr<ITexture>   m_albedo;
@@ -38,7 +39,7 @@ class CMaterialMetal : public IMaterial
 public:
     CMaterialMetal(const glm::vec3 &color, float glossiness);
 
-    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const override;
+    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const override;
 
 public:
     glm::vec3   m_albedo;
@@ -52,7 +53,7 @@ class CMaterialGlass : public IMaterial
 public:
     CMaterialGlass(float refrativeIndex, float glossiness);
 
-    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered) const override;
+    virtual bool    Scatter(const CRay &ray, const SHitRec &hitRec, glm::vec3 &attenuation, CRay &scattered, CRandom &rng) const override;
 
 public:
     float   m_refractiveIndex;
@@ -0,0 +1,101 @@
+#include "memory_arena.h"
+
+#include <algorithm>
+#include <cstddef>  // max_align_t
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+static constexpr size_t     s_alignment = alignof(std::max_align_t);
+
+//----------------------------------------------------
+
+CMemoryArena::CMemoryArena(size_t blockSize)
+: m_blockSize(blockSize)
+, m_currentBlock{ 0, nullptr }
+, m_currentPos(0)
+{
+}
+
+//----------------------------------------------------
+
+CMemoryArena::~CMemoryArena()
+{
+    Release();
+}
+
+//----------------------------------------------------
+
+void*   CMemoryArena::Alloc(size_t bytes)
+{
+    bytes = (bytes + s_alignment - 1) & ~(s_alignment - 1);
+
+    if (m_currentPos + bytes > m_currentBlock.size)
+    {
+        if (m_currentBlock.ptr != nullptr)
+            m_usedBlocks.push_back(m_currentBlock);
+        m_currentBlock = { 0, nullptr };
+
+        // reuse a free block if one is large enough
+        for (size_t i = 0; i < m_availableBlocks.size(); i++)
+        {
+            if (m_availableBlocks[i].size >= bytes)
+            {
+                m_currentBlock = m_availableBlocks[i];
+                m_availableBlocks.erase(m_availableBlocks.begin() + i);
+                break;
+            }
+        }
+
+        if (m_currentBlock.ptr == nullptr)
+        {
+            m_currentBlock.size = std::max(bytes, m_blockSize);
+            m_currentBlock.ptr = (char*)::operator new(m_currentBlock.size);
+        }
+        m_currentPos = 0;
+    }
+
+    void    *ptr = m_currentBlock.ptr + m_currentPos;
+    m_currentPos += bytes;
+
+    return ptr;
+}
+
+//----------------------------------------------------
+
+void    CMemoryArena::Reset()
+{
+    m_currentPos = 0;
+    m_availableBlocks.insert(m_availableBlocks.end(), m_usedBlocks.begin(), m_usedBlocks.end());
+    m_usedBlocks.clear();
+}
+
+//----------------------------------------------------
+
+void    CMemoryArena::Release()
+{
+    Reset();
+
+    for (const SBlock &block : m_availableBlocks)
+        ::operator delete(block.ptr);
+    m_availableBlocks.clear();
+
+    ::operator delete(m_currentBlock.ptr);
+    m_currentBlock = { 0, nullptr };
+}
+
+//----------------------------------------------------
+
+size_t  CMemoryArena::GetTotalAllocated() const
+{
+    size_t  total = m_currentBlock.size;
+    for (const SBlock &block : m_usedBlocks)
+        total += block.size;
+    for (const SBlock &block : m_availableBlocks)
+        total += block.size;
+
+    return total;
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
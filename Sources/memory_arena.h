@@ -0,0 +1,68 @@
+#pragma once
+
+/*************************************************************************
+*
+*		memory_arena.h
+*
+*		Monotonic block allocator for short-lived build data. Objects
+*		are carved out of large blocks and never freed individually,
+*		the whole arena is reset or released in one go. Not thread
+*		safe, use one arena per thread.
+*
+*		Based on MemoryArena from "Physically Based Rendering",
+*		chapter A.4.3. https://www.pbrt.org/
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include <new>      // placement new
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CMemoryArena
+{
+public:
+    explicit CMemoryArena(size_t blockSize = 256 * 1024);
+    ~CMemoryArena();
+
+    CMemoryArena(const CMemoryArena&) = delete;
+    CMemoryArena&   operator= (const CMemoryArena&) = delete;
+
+    void*   Alloc(size_t bytes);
+
+    // default constructed, destructors are never run, so "T" should be
+    // trivially destructible
+    template <typename T>
+    T*      Alloc(size_t n = 1)
+    {
+        T   *ptr = (T*)Alloc(n * sizeof(T));
+        for (size_t i = 0; i < n; i++)
+            new (&ptr[i]) T();
+        return ptr;
+    }
+
+    // make all memory available again, blocks are kept for reuse
+    void    Reset();
+    // return all blocks to the system
+    void    Release();
+
+    size_t  GetTotalAllocated() const;
+
+private:
+    struct SBlock
+    {
+        size_t  size;
+        char    *ptr;
+    };
+
+    size_t              m_blockSize;
+    SBlock              m_currentBlock;
+    size_t              m_currentPos;
+    std::vector<SBlock> m_usedBlocks;
+    std::vector<SBlock> m_availableBlocks;
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
@@ -0,0 +1,238 @@
+#include "mesh_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>  // memcmp
+#include <fstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// file layout (native endianness), sections start at "s_cacheAlignment"
+struct SMeshCacheHeader
+{
+    char        magic[4];       // "CRMC"
+    u_int32_t   version;
+    uint64_t    fileHash;
+    int32_t     partition;
+    int32_t     maxHittablesInNode;
+    int32_t     restructure;
+    u_int32_t   nodeSize;
+    u_int32_t   nVertices;
+    u_int32_t   nIndices;
+    u_int32_t   nHittables;
+    u_int32_t   nNodes;
+    float       sahCost;
+    uint64_t    verticesOffset;
+    uint64_t    indicesOffset;
+    uint64_t    orderOffset;
+    uint64_t    nodesOffset;
+    uint64_t    fileSize;
+};
+
+static const char       s_cacheMagic[4] = { 'C', 'R', 'M', 'C' };
+static const u_int32_t  s_cacheVersion = 2;
+static const uint64_t   s_cacheAlignment = 64;
+
+//----------------------------------------------------
+
+static uint64_t     _AlignOffset(uint64_t offset)
+{
+    return (offset + s_cacheAlignment - 1) & ~(s_cacheAlignment - 1);
+}
+
+// whether "count" elements of "elementSize" at "offset" fit into "fileSize",
+// without overflowing on hostile header values
+static bool         _SectionFits(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t fileSize)
+{
+    return offset % s_cacheAlignment == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
+
+//----------------------------------------------------
+
+CMappedFile::~CMappedFile()
+{
+    if (m_data != nullptr)
+        munmap(m_data, m_size);
+}
+
+//----------------------------------------------------
+
+bool    CMappedFile::Open(const char* filename)
+{
+    int     fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat     st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void    *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    m_data = (char*)data;
+    m_size = st.st_size;
+    return true;
+}
+
+//----------------------------------------------------
+
+uint64_t    HashFile(const char* filename)
+{
+    FILE    *file = fopen(filename, "rb");
+    if (file == nullptr)
+        return 0;
+
+    // FNV-1a over 8 byte words, the tail is zero padded so the length is
+    // hashed as well
+    const uint64_t      prime = 0x100000001b3ull;
+    uint64_t            hash = 0xcbf29ce484222325ull;
+    uint64_t            length = 0;
+    std::vector<char>   buffer(1 << 20);
+    size_t              n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+    {
+        for (size_t i = 0; i < n; i += 8)
+        {
+            uint64_t    word = 0;
+            memcpy(&word, &buffer[i], std::min<size_t>(8, n - i));
+            hash = (hash ^ word) * prime;
+        }
+        length += n;
+    }
+    fclose(file);
+
+    return (hash ^ length) * prime;
+}
+
+//----------------------------------------------------
+
+bool    SaveMeshCache(const char* filename, const SMeshCacheKey &key,
+                      const std::vector<glm::vec3> &vertices, const std::vector<uint32_t> &indices,
+                      const std::vector<u_int32_t> &hittableOrder,
+                      const void *nodes, u_int32_t nNodes, u_int32_t nodeSize, float sahCost)
+{
+    SMeshCacheHeader    header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_cacheMagic, sizeof(header.magic));
+    header.version = s_cacheVersion;
+    header.fileHash = key.fileHash;
+    header.partition = key.partition;
+    header.maxHittablesInNode = key.maxHittablesInNode;
+    header.restructure = key.restructure;
+    header.nodeSize = nodeSize;
+    header.nVertices = vertices.size();
+    header.nIndices = indices.size();
+    header.nHittables = hittableOrder.size();
+    header.nNodes = nNodes;
+    header.sahCost = sahCost;
+    header.verticesOffset = _AlignOffset(sizeof(header));
+    header.indicesOffset = _AlignOffset(header.verticesOffset + vertices.size() * sizeof(glm::vec3));
+    header.orderOffset = _AlignOffset(header.indicesOffset + indices.size() * sizeof(uint32_t));
+    header.nodesOffset = _AlignOffset(header.orderOffset + hittableOrder.size() * sizeof(u_int32_t));
+    header.fileSize = header.nodesOffset + (uint64_t)nNodes * nodeSize;
+
+    // written aside and renamed, so concurrent loaders never see a partial file
+    std::string     tmpName = std::string(filename) + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream   file(tmpName, std::ios::binary);
+        if (!file)
+        {
+            printf("[Cache] Error: Cannot open \"%s\" for writing\n", tmpName.c_str());
+            return false;
+        }
+
+        auto    writeAt = [&file](uint64_t offset, const void *data, size_t bytes) {
+            static const char   zeros[s_cacheAlignment] = {};
+            file.write(zeros, offset - (uint64_t)file.tellp());
+            file.write((const char*)data, bytes);
+        };
+
+        file.write((const char*)&header, sizeof(header));
+        writeAt(header.verticesOffset, vertices.data(), vertices.size() * sizeof(glm::vec3));
+        writeAt(header.indicesOffset, indices.data(), indices.size() * sizeof(uint32_t));
+        writeAt(header.orderOffset, hittableOrder.data(), hittableOrder.size() * sizeof(u_int32_t));
+        writeAt(header.nodesOffset, nodes, (size_t)nNodes * nodeSize);
+
+        if (!file.good())
+        {
+            printf("[Cache] Error: Failed to write \"%s\"\n", tmpName.c_str());
+            file.close();
+            remove(tmpName.c_str());
+            return false;
+        }
+    }
+
+    if (rename(tmpName.c_str(), filename) != 0)
+    {
+        printf("[Cache] Error: Cannot replace \"%s\"\n", filename);
+        remove(tmpName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    LoadMeshCache(const char* filename, const SMeshCacheKey &key, u_int32_t nodeSize, SMeshCache &cache)
+{
+    auto    file = std::make_shared<CMappedFile>();
+    if (!file->Open(filename) || file->GetSize() < sizeof(SMeshCacheHeader))
+        return false;
+
+    const SMeshCacheHeader  &header = *(const SMeshCacheHeader*)file->GetData();
+    if (memcmp(header.magic, s_cacheMagic, sizeof(s_cacheMagic)) != 0 || header.version != s_cacheVersion)
+    {
+        printf("[Cache] \"%s\" is not a version %u mesh cache, ignoring it\n", filename, s_cacheVersion);
+        return false;
+    }
+
+    if (header.fileHash != key.fileHash || header.partition != key.partition ||
+        header.maxHittablesInNode != key.maxHittablesInNode || header.restructure != key.restructure ||
+        header.nodeSize != nodeSize)
+    {
+        printf("[Cache] \"%s\" is out of date, ignoring it\n", filename);
+        return false;
+    }
+
+    const uint64_t  size = file->GetSize();
+    if (header.fileSize != size ||
+        !_SectionFits(header.verticesOffset, header.nVertices, sizeof(glm::vec3), size) ||
+        !_SectionFits(header.indicesOffset, header.nIndices, sizeof(uint32_t), size) ||
+        !_SectionFits(header.orderOffset, header.nHittables, sizeof(u_int32_t), size) ||
+        !_SectionFits(header.nodesOffset, header.nNodes, nodeSize, size))
+    {
+        printf("[Cache] \"%s\" is truncated or corrupt, ignoring it\n", filename);
+        return false;
+    }
+
+    char    *data = file->GetData();
+    cache.vertices = (const glm::vec3*)(data + header.verticesOffset);
+    cache.nVertices = header.nVertices;
+    cache.indices = (const uint32_t*)(data + header.indicesOffset);
+    cache.nIndices = header.nIndices;
+    cache.hittableOrder = (const u_int32_t*)(data + header.orderOffset);
+    cache.nHittables = header.nHittables;
+    cache.nodes = data + header.nodesOffset;
+    cache.nNodes = header.nNodes;
+    cache.sahCost = header.sahCost;
+    cache.file = file;
+
+    return true;
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
@@ -0,0 +1,83 @@
+#pragma once
+
+/*************************************************************************
+*
+*		mesh_cache.h
+*
+*		Binary cache of a loaded mesh and its bvh-tree: welded
+*		vertices, indices, the leaf order of the triangles and the
+*		flattened nodes. Warm starts skip parsing the obj and
+*		building the tree, the file is memory mapped and the nodes
+*		are used in place.
+*
+*		A cache is keyed by a hash of the source file and the build
+*		settings. Any mismatch, or a new format version, makes the
+*		loader ignore it so it is rebuilt. So does a damaged file:
+*		every section has to lie inside the file and the tree has to
+*		index only its own nodes and faces.
+*
+**************************************************************************/
+
+#include "common.h"
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// read-only view of a whole file. Pages are private copy-on-write, so the
+// data may be modified without touching the file.
+class CMappedFile
+{
+public:
+    CMappedFile() {}
+    ~CMappedFile();
+
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile&    operator= (const CMappedFile&) = delete;
+
+    bool            Open(const char* filename);
+    char*           GetData() const { return m_data; }
+    size_t          GetSize() const { return m_size; }
+
+private:
+    char            *m_data = nullptr;
+    size_t          m_size = 0;
+};
+
+//----------------------------------------------------
+
+struct SMeshCacheKey
+{
+    uint64_t    fileHash = 0;               // HashFile() of the source mesh
+    int32_t     partition = 0;              // CBVHAccel::EPartitionType
+    int32_t     maxHittablesInNode = 0;
+    int32_t     restructure = 0;            // treelet restructured bvh-tree
+};
+
+// view into a mapped cache file, valid while "file" is alive
+struct SMeshCache
+{
+    std::shared_ptr<CMappedFile>    file;
+
+    const glm::vec3     *vertices = nullptr;
+    u_int32_t           nVertices = 0;
+    const uint32_t      *indices = nullptr;
+    u_int32_t           nIndices = 0;
+    const u_int32_t     *hittableOrder = nullptr;   // face of every bvh leaf slot
+    u_int32_t           nHittables = 0;
+    void                *nodes = nullptr;           // flattened CBVHAccel nodes
+    u_int32_t           nNodes = 0;
+    float               sahCost = 0.f;
+};
+
+// 64 bit FNV-1a of the file content, 0 if it cannot be read
+uint64_t    HashFile(const char* filename);
+
+// "nodeSize" guards against a changed node layout
+bool        SaveMeshCache(const char* filename, const SMeshCacheKey &key,
+                          const std::vector<glm::vec3> &vertices, const std::vector<uint32_t> &indices,
+                          const std::vector<u_int32_t> &hittableOrder,
+                          const void *nodes, u_int32_t nNodes, u_int32_t nodeSize, float sahCost);
+bool        LoadMeshCache(const char* filename, const SMeshCacheKey &key, u_int32_t nodeSize, SMeshCache &cache);
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
@@ -0,0 +1,101 @@
+#pragma once
+
+/*************************************************************************
+*
+*		morton.h
+*
+*		Space-filling curve helpers. Morton (Z-order) codes interleave
+*		coordinate bits, Hilbert indices additionally keep every step
+*		between neighbors, both map nearby points to nearby indices.
+*		3D codes sort primitives for the linear BVH builder.
+*
+**************************************************************************/
+
+#include "common.h"
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// spread the lower 16 bits of x to the even bits
+inline uint32_t     MortonPart1By1(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x ^ (x << 8)) & 0x00ff00ff;
+    x = (x ^ (x << 4)) & 0x0f0f0f0f;
+    x = (x ^ (x << 2)) & 0x33333333;
+    x = (x ^ (x << 1)) & 0x55555555;
+    return x;
+}
+
+// 2D morton code of two 16-bit coordinates
+inline uint32_t     MortonEncode2D(uint32_t x, uint32_t y)
+{
+    return (MortonPart1By1(y) << 1) | MortonPart1By1(x);
+}
+
+//----------------------------------------------------
+
+// spread the lower 10 bits of x to every third bit
+inline uint32_t     MortonPart1By2(uint32_t x)
+{
+    x &= 0x000003ff;
+    x = (x ^ (x << 16)) & 0xff0000ff;
+    x = (x ^ (x <<  8)) & 0x0300f00f;
+    x = (x ^ (x <<  4)) & 0x030c30c3;
+    x = (x ^ (x <<  2)) & 0x09249249;
+    return x;
+}
+
+// 30-bit morton code of three 10-bit coordinates, bit i belongs to axis i % 3
+inline uint32_t     MortonEncode3D(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (MortonPart1By2(z) << 2) | (MortonPart1By2(y) << 1) | MortonPart1By2(x);
+}
+
+// spread the lower 21 bits of x to every third bit
+inline uint64_t     MortonPart1By2(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x ^ (x << 32)) & 0x001f00000000ffffull;
+    x = (x ^ (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x ^ (x <<  8)) & 0x100f00f00f00f00full;
+    x = (x ^ (x <<  4)) & 0x10c30c30c30c30c3ull;
+    x = (x ^ (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+// 63-bit morton code of three 21-bit coordinates
+inline uint64_t     MortonEncode3D(uint64_t x, uint64_t y, uint64_t z)
+{
+    return (MortonPart1By2(z) << 2) | (MortonPart1By2(y) << 1) | MortonPart1By2(x);
+}
+
+//----------------------------------------------------
+
+// hilbert index of (x, y) on a n x n grid, n must be a power of two
+inline uint32_t     HilbertEncode2D(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t    d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t    rx = (x & s) > 0;
+        uint32_t    ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+
+    return d;
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
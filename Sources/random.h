@@ -0,0 +1,77 @@
+#pragma once
+
+/*************************************************************************
+*
+*		random.h
+*
+*		Small-state PCG32 random number generator (pcg-random.org).
+*		Generators live on the stack of the thread that uses them,
+*		there is no shared state, and every stream is derived from
+*		(pixel, sample, bounce) so renders are reproducible regardless
+*		of thread count or scheduling order.
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include "glm/gtc/constants.hpp"   // pi
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CRandom
+{
+public:
+    // "stream" selects one of 2^63 independent sequences for the same seed
+    CRandom(uint64_t seed, uint64_t stream = 0)
+    : m_state(0)
+    , m_inc((stream << 1u) | 1u)
+    {
+        NextUInt();
+        m_state += seed;
+        NextUInt();
+    }
+
+    uint32_t    NextUInt()
+    {
+        uint64_t    old = m_state;
+        m_state = old * 6364136223846793005ULL + m_inc;
+
+        uint32_t    xorShifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        uint32_t    rot = (uint32_t)(old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+    }
+
+    // uniform in [0, 1)
+    float       NextFloat()
+    {
+        // top 24 bits fill the float mantissa exactly
+        return (NextUInt() >> 8) * (1.f / 16777216.f);
+    }
+
+    // uniform direction on the unit sphere
+    glm::vec3   NextUnitVector()
+    {
+        float   z = 1.f - 2.f * NextFloat();
+        float   r = glm::sqrt(glm::max(0.f, 1.f - z * z));
+        float   phi = 2.f * glm::pi<float>() * NextFloat();
+
+        return glm::vec3(r * glm::cos(phi), r * glm::sin(phi), z);
+    }
+
+    // stateless 64-bit mix (splitmix64 finalizer), used to build seeds
+    static uint64_t     Hash(uint64_t a, uint64_t b = 0)
+    {
+        uint64_t    x = a ^ (b + 0x9E3779B97F4A7C15ULL + (a << 6) + (a >> 2));
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+private:
+    uint64_t    m_state;
+    uint64_t    m_inc;
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
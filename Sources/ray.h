@@ -22,5 +22,23 @@ public:
     glm::vec3   m_dir;
 };
 
+//----------------------------------------------------
+
+// Per-ray data for box tests, computed once per traversal instead of once
+// per node
+struct STraversalRay
+{
+    explicit STraversalRay(const CRay &ray)
+    : origin(ray.m_origin)
+    , invDir(1.f / ray.m_dir)
+    , octant{ invDir.x < 0, invDir.y < 0, invDir.z < 0 }
+    {
+    }
+
+    glm::vec3   origin;
+    glm::vec3   invDir;
+    int         octant[3];      // per axis, 1 -> negative direction (far plane is pMin)
+};
+
 //----------------------------------------------------
 _CR_NAMESPACE_END
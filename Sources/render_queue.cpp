@@ -0,0 +1,178 @@
+#include "render_queue.h"
+#include "thread_pool.h"
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+CRenderQueue::CRenderQueue(CRenderer &renderer)
+: m_renderer(renderer)
+, m_nextJobId(0)
+, m_activeTasks(0)
+{
+}
+
+//----------------------------------------------------
+
+CRenderQueue::~CRenderQueue()
+{
+    // pool tasks reference the queue, let every one of them return
+    std::unique_lock<std::mutex>    lock(m_mutex);
+    m_doneCond.wait(lock, [this] { return m_activeTasks == 0; });
+}
+
+//----------------------------------------------------
+
+int     CRenderQueue::Submit(const SRenderJob &job)
+{
+    auto    state = std::make_unique<SJobState>();
+    state->job = job;
+    state->submitTime = TClock::now();
+    state->deadline = TClock::time_point::max();
+    if (job.deadlineMs > 0.f)
+        state->deadline = state->submitTime + std::chrono::microseconds((int64_t)(job.deadlineMs * 1000.f));
+
+    CRenderer::BuildTiles(job.setting, state->tiles, state->pixelOrder);
+    CRenderer::GetSampleRange(job.setting, state->sampleBegin, state->sampleEnd);
+    state->pixmap = std::make_unique<float[]>(job.setting.render_w * job.setting.render_h * 3);
+
+    const size_t    nTiles = state->tiles.size();
+    const u_int32_t nSamples = state->sampleEnd - state->sampleBegin;
+    int             id;
+    {
+        std::lock_guard<std::mutex>     lock(m_mutex);
+        id = m_nextJobId++;
+        state->id = id;
+        m_jobs[id] = std::move(state);
+        m_activeTasks += nTiles;
+    }
+
+    printf("[Queue] Job %d \"%s\" submitted: %ux%u, %u spp, priority %d\n",
+           id, job.name.c_str(), job.setting.render_w, job.setting.render_h, nSamples, job.priority);
+
+    // one task per tile, but a task renders the most urgent tile at the time
+    // it runs, not necessarily one of this job
+    CThreadPool     &pool = m_renderer.GetThreadPool();
+    for (size_t i = 0; i < nTiles; i++)
+        pool.Submit([this] { _RenderNextTile(); });
+
+    return id;
+}
+
+//----------------------------------------------------
+
+void    CRenderQueue::Wait(int jobId)
+{
+    std::unique_lock<std::mutex>    lock(m_mutex);
+    m_doneCond.wait(lock, [this, jobId] {
+        auto it = m_jobs.find(jobId);
+        return it == m_jobs.end() || it->second->isFinished;
+    });
+}
+
+//----------------------------------------------------
+
+void    CRenderQueue::WaitAll()
+{
+    std::unique_lock<std::mutex>    lock(m_mutex);
+    m_doneCond.wait(lock, [this] { return m_activeTasks == 0; });
+}
+
+//----------------------------------------------------
+
+bool    CRenderQueue::IsFinished(int jobId)
+{
+    std::lock_guard<std::mutex>     lock(m_mutex);
+    auto    it = m_jobs.find(jobId);
+    return it == m_jobs.end() || it->second->isFinished;
+}
+
+//----------------------------------------------------
+
+bool    CRenderQueue::TakeResult(int jobId, std::vector<float> &outMap)
+{
+    std::unique_lock<std::mutex>    lock(m_mutex);
+    m_doneCond.wait(lock, [this, jobId] {
+        auto it = m_jobs.find(jobId);
+        return it == m_jobs.end() || it->second->isFinished;
+    });
+    if (m_jobs.find(jobId) == m_jobs.end())
+        return false;
+
+    // the accumulation was already resolved in place when the job finished
+    SJobState   &state = *m_jobs[jobId];
+    size_t      size = state.job.setting.render_w * state.job.setting.render_h * 3;
+    outMap.assign(state.pixmap.get(), state.pixmap.get() + size);
+    m_jobs.erase(jobId);
+
+    return true;
+}
+
+//----------------------------------------------------
+
+CRenderQueue::SJobState*    CRenderQueue::_PickJob()
+{
+    // highest priority first, earliest deadline within the same priority,
+    // then submission order
+    SJobState   *best = nullptr;
+    for (auto &it : m_jobs)
+    {
+        SJobState   *state = it.second.get();
+        if (state->nextTile >= state->tiles.size())
+            continue;
+
+        if (best == nullptr ||
+            state->job.priority > best->job.priority ||
+            (state->job.priority == best->job.priority && state->deadline < best->deadline))
+            best = state;
+    }
+
+    return best;
+}
+
+//----------------------------------------------------
+
+void    CRenderQueue::_RenderNextTile()
+{
+    SJobState   *state;
+    STile       tile;
+    {
+        std::lock_guard<std::mutex>     lock(m_mutex);
+        state = _PickJob();
+        tile = state->tiles[state->nextTile++];
+    }
+
+    // jobs are only erased once finished, so "state" stays valid until this
+    // tile is counted as done
+    m_renderer.RenderTile(state->job.camera, state->job.setting, state->pixelOrder,
+                          tile, state->sampleBegin, state->sampleEnd, state->pixmap.get());
+
+    std::lock_guard<std::mutex>     lock(m_mutex);
+    if (++state->doneTiles == state->tiles.size())
+        _FinishJob(*state);
+
+    // last access to the queue, see ~CRenderQueue
+    m_activeTasks--;
+    m_doneCond.notify_all();
+}
+
+//----------------------------------------------------
+
+void    CRenderQueue::_FinishJob(SJobState &state)
+{
+    // an empty sample range leaves a black image
+    const SRenderSetting    &setting = state.job.setting;
+    const size_t            size = setting.render_w * setting.render_h * 3;
+    const u_int32_t         nSamples = std::max(1u, state.sampleEnd - state.sampleBegin);
+    CRenderer::ToneMap(state.pixmap.get(), state.pixmap.get(), size, 1.f / nSamples);
+    state.isFinished = true;
+
+    TClock::time_point  now = TClock::now();
+    float   elapsedMs = std::chrono::duration<float, std::milli>(now - state.submitTime).count();
+    printf("[Queue] Job %d \"%s\" done in %.3fs", state.id, state.job.name.c_str(), elapsedMs / 1000.f);
+    if (state.deadline != TClock::time_point::max())
+        printf(" (deadline %s)", now <= state.deadline ? "met" : "missed");
+    printf("\n");
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
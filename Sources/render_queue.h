@@ -0,0 +1,91 @@
+#pragma once
+
+/*************************************************************************
+*
+*		render_queue.h
+*
+*		In-process queue of render jobs sharing one loaded scene and
+*		the renderer's worker pool. Every pool task renders a single
+*		tile of whichever job is most urgent at that moment, so a
+*		high-priority preview submitted while a final is running
+*		takes over at the next tile boundary.
+*
+**************************************************************************/
+
+#include "renderer.h"
+#include "camera.h"
+
+#include <chrono>   // steady_clock
+#include <condition_variable>
+#include <map>
+#include <string>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+struct SRenderJob
+{
+    std::string     name;
+    SRenderSetting  setting;            // resolution, samples, depth, tiling
+    CCamera         camera;
+    int             priority = 0;       // higher runs first
+    float           deadlineMs = 0.f;   // relative to submission, 0 -> none
+};
+
+//----------------------------------------------------
+
+class CRenderQueue
+{
+public:
+    // "renderer" provides the scene and the worker pool, it must outlive
+    // the queue and have its scene initialized
+    explicit CRenderQueue(CRenderer &renderer);
+    ~CRenderQueue();
+
+    // returns the job id
+    int     Submit(const SRenderJob &job);
+
+    void    Wait(int jobId);
+    void    WaitAll();
+    bool    IsFinished(int jobId);
+
+    // Move the display-ready (gamma corrected) image of a finished job into
+    // "outMap" and forget the job. Blocks until the job is done.
+    bool    TakeResult(int jobId, std::vector<float> &outMap);
+
+private:
+    using TClock = std::chrono::steady_clock;
+
+    struct SJobState
+    {
+        int                         id;
+        SRenderJob                  job;
+        std::vector<STile>          tiles;
+        std::vector<glm::u16vec2>   pixelOrder;
+        std::unique_ptr<float[]>    pixmap;
+        u_int32_t                   sampleBegin;    // range of "job.setting", see CRenderer::GetSampleRange
+        u_int32_t                   sampleEnd;
+        size_t                      nextTile = 0;   // next tile to hand out
+        size_t                      doneTiles = 0;
+        bool                        isFinished = false;
+
+        TClock::time_point          submitTime;
+        TClock::time_point          deadline;       // max() -> none
+    };
+
+    SJobState*  _PickJob();
+    void        _RenderNextTile();
+    void        _FinishJob(SJobState &state);
+
+private:
+    CRenderer                               &m_renderer;
+
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_doneCond;
+    std::map<int, std::unique_ptr<SJobState>>   m_jobs;
+    int                                     m_nextJobId;
+    size_t                                  m_activeTasks;      // pool tasks not returned yet
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
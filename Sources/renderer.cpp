@@ -2,6 +2,13 @@
 #include "hittable_list.h"
 #include "camera.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "random.h"
+#include "morton.h"
+#include "topology.h"
+#include "image.h"
+
+#include "glm/gtc/matrix_transform.hpp"
 
 #include <chrono>   // steady_clock
 
@@ -13,43 +20,44 @@ CRenderer::CRenderer()
 , m_camera(std::make_shared<CCamera>(CCamera()))
 , m_isFinished(false)
 , m_currentSample(0)
+, m_currentTile(0)
+, m_msPerTile(0.f)
 , m_pixmap(nullptr)
+, m_stopRenderThread(false)
+, m_hasNewFrame(false)
 {
 }
 
 //----------------------------------------------------
 
+CRenderer::~CRenderer()
+{
+    // join workers before releasing the buffers they write to
+    StopRenderThread();
+    m_threadPool.reset();
+
+    delete[] m_pixmap;
+}
+
+//----------------------------------------------------
+
 void    CRenderer::FullRender()
 {
-    if (m_pixmap == nullptr)    // initial render
-        m_pixmap = new float[m_renderSetting.render_w * m_renderSetting.render_h * 3];
-    else if (m_isFinished)      // previous render exists
-        _ClearOldRender();
+    _BeginRender();
 
     // Render loop
-    printf("[Render] Start rendering...\n");
+    printf("[Render] Start rendering with %u threads...\n", m_threadPool->GetThreadCount());
     fflush(stdout);
 
     // Timer
     auto            begin = std::chrono::steady_clock::now();
 
-    for (size_t w = 0; w < m_renderSetting.render_w; w++) {
-        for (size_t h = 0; h < m_renderSetting.render_h; h++) {
-            for (size_t s = 0; s < m_renderSetting.nSamples; s++)
-            {
-                int     si = s % m_renderSetting.nSamplesW;
-                int     sj = s / m_renderSetting.nSamplesW;
-                float   u = (w + (float)si / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_w;
-                float   v = (h + (float)sj / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_h;
-                CRay        ray = m_camera->GetRay(u, v);
-                glm::vec3   color = _RecursiveRaycast(ray, m_renderSetting.nMaxDepth);
-
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0] += color.r;
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1] += color.g;
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2] += color.b;
-            }
-        }
-    }
+    m_threadPool->ResetStats();
+    for (SWorkerCounter &counter : m_workerCounters)
+        counter.nSamples = 0;
+    u_int32_t   sampleBegin, sampleEnd;
+    GetSampleRange(m_renderSetting, sampleBegin, sampleEnd);
+    _RenderTilesParallel(0, m_tiles.size(), sampleBegin, sampleEnd);
 
     m_isFinished = true;
     m_currentSample = m_renderSetting.nSamples;     // because it will be used for AA correction later
@@ -59,70 +67,156 @@ void    CRenderer::FullRender()
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
     printf("[Render] Done.\n");
     printf("[Render] Elpased: %.3fs.\n", elapsed / 1000.f);
+
+    // per-thread utilization, busy time over wall time
+    auto    stats = m_threadPool->GetStats();
+    double  totalBusyMs = 0.0;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        float   utilization = elapsed > 0 ? 100.f * stats[i].busyMs / elapsed : 100.f;
+        printf("[Render] Thread %2zu: busy %.3fs (%5.1f%%), %llu tiles, %llu stolen\n",
+               i, stats[i].busyMs / 1000.0, utilization,
+               (unsigned long long)stats[i].nTasks, (unsigned long long)stats[i].nSteals);
+        totalBusyMs += stats[i].busyMs;
+    }
+    if (elapsed > 0)
+        printf("[Render] Utilization: %.1f%% (%.2f threads busy on average)\n",
+               100.0 * totalBusyMs / (elapsed * stats.size()), totalBusyMs / elapsed);
+
+    _PrintNodeThroughput(elapsed);
 }
 
 //----------------------------------------------------
 
 void    CRenderer::ProgressiveRender()
 {
-    if (m_pixmap == nullptr)    // initial render
-        m_pixmap = new float[m_renderSetting.render_w * m_renderSetting.render_h * 3];
-    else if (m_isFinished)      // previous render exists
-        _ClearOldRender();
+    _BeginRender();
 
-    // TODO: Timer for progressive rendering
+    // finish the current pass, a budgeted call may have left it half done
+    _RenderTilesParallel(m_currentTile, m_tiles.size(), m_currentSample, m_currentSample + 1);
+    m_currentTile = m_tiles.size();
+    _AdvancePass();
+}
 
-    for (size_t w = 0; w < m_renderSetting.render_w; w++) {
-        for (size_t h = 0; h < m_renderSetting.render_h; h++) {
-            int     si = m_currentSample % m_renderSetting.nSamplesW;
-            int     sj = m_currentSample / m_renderSetting.nSamplesW;
-            float   u = (w + (float)si / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_w;
-            float   v = (h + (float)sj / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_h;
-            CRay        ray = m_camera->GetRay(u, v);
-            glm::vec3   color = _RecursiveRaycast(ray, m_renderSetting.nMaxDepth);
+//----------------------------------------------------
 
-            m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0] += color.r;
-            m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1] += color.g;
-            m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2] += color.b;
-        }
+void    CRenderer::ProgressiveRender(float budgetMs)
+{
+    _BeginRender();
+
+    using TClock = std::chrono::steady_clock;
+    const auto  begin = TClock::now();
+    const size_t    nThreads = m_threadPool->GetThreadCount();
+
+    while (!m_isFinished)
+    {
+        float   elapsedMs = std::chrono::duration<float, std::milli>(TClock::now() - begin).count();
+        float   remainingMs = budgetMs - elapsedMs;
+        if (remainingMs <= 0.f)
+            break;
+
+        // size the batch from the measured throughput. A batch runs in rounds
+        // of one tile per thread, tile cost varies a lot across the image, so
+        // only spend half of what is left per batch and re-measure, which
+        // bounds the overshoot. Without a measurement yet, run one round.
+        size_t  nRounds = 1;
+        if (m_msPerTile > 0.f)
+            nRounds = (size_t)(0.5f * remainingMs / m_msPerTile);
+        size_t  nBatch = std::max<size_t>(1, nRounds * nThreads);
+        nBatch = std::min(nBatch, m_tiles.size() - m_currentTile);
+
+        const auto  batchBegin = TClock::now();
+        _RenderTilesParallel(m_currentTile, m_currentTile + nBatch, m_currentSample, m_currentSample + 1);
+        float   batchMs = std::chrono::duration<float, std::milli>(TClock::now() - batchBegin).count();
+
+        // smoothed wall time of a single round
+        float   msPerTile = batchMs / (float)((nBatch + nThreads - 1) / nThreads);
+        m_msPerTile = m_msPerTile > 0.f ? 0.5f * (m_msPerTile + msPerTile) : msPerTile;
+
+        m_currentTile += nBatch;
+        if (m_currentTile >= m_tiles.size())
+            _AdvancePass();
     }
+}
+
+//----------------------------------------------------
 
-    if (++m_currentSample >= m_renderSetting.nSamples)
+void    CRenderer::GetLastRender(float* &outMap)
+{
+    if (outMap == nullptr)
+        outMap = new float[m_renderSetting.render_w * m_renderSetting.render_h * 3];
+
+    _Resolve(outMap);
+}
+
+//----------------------------------------------------
+
+void    CRenderer::GetAccumulation(SAccumulation &acc) const
+{
+    const size_t    nPixels = m_renderSetting.render_w * m_renderSetting.render_h;
+
+    acc.width = m_renderSetting.render_w;
+    acc.height = m_renderSetting.render_h;
+    acc.counts.assign(nPixels, 0);
+    if (m_pixmap == nullptr)    // nothing rendered yet
     {
-        m_isFinished = true;
-        printf("[Render] Done.\n");
+        acc.accum.assign(nPixels * 3, 0.f);
+        return;
     }
-    else
+    acc.accum.assign(m_pixmap, m_pixmap + nPixels * 3);
+
+    for (size_t t = 0; t < m_tiles.size(); t++)
     {
-        printf("[Render] Progress: %.2f%%\n", 100.f * m_currentSample / m_renderSetting.nSamples);
+        const STile     &tile = m_tiles[t];
+        for (size_t h = tile.y0; h < tile.y1; h++)
+            std::fill(&acc.counts[h * acc.width + tile.x0], &acc.counts[h * acc.width + tile.x1], m_tileSamples[t]);
     }
+}
 
+//----------------------------------------------------
+
+void    CRenderer::StartRenderThread()
+{
+    if (m_renderThread.joinable())
+        return;
+
+    const size_t    size = m_renderSetting.render_w * m_renderSetting.render_h * 3;
+    m_backBuffer = std::make_unique<float[]>(size);
+    m_readyBuffer = std::make_unique<float[]>(size);
+    m_frontBuffer = std::make_unique<float[]>(size);
+    m_hasNewFrame = false;
+
+    m_stopRenderThread = false;
+    m_renderThread = std::thread(&CRenderer::_RenderThreadLoop, this);
 }
 
 //----------------------------------------------------
 
-void    CRenderer::GetLastRender(float* &outMap)
+void    CRenderer::StopRenderThread()
 {
-    if (outMap == nullptr)
-        outMap = new float[m_renderSetting.render_w * m_renderSetting.render_h * 3];
+    if (!m_renderThread.joinable())
+        return;
 
-    for (size_t w = 0; w < m_renderSetting.render_w; w++) {
-        for (size_t h = 0; h < m_renderSetting.render_h; h++) 
-        {
-            glm::vec3 rawColor( m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0],
-                                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1],
-                                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2]);
-
-            // gamma correction
-            float   scale = 1.0f / m_currentSample;
-            rawColor = glm::sqrt(rawColor * scale);
-
-            // copy
-            outMap[(h * m_renderSetting.render_w + w) * 3 + 0] = rawColor.r;
-            outMap[(h * m_renderSetting.render_w + w) * 3 + 1] = rawColor.g;
-            outMap[(h * m_renderSetting.render_w + w) * 3 + 2] = rawColor.b;
-        }
+    // the current pass is finished before the thread observes the flag
+    m_stopRenderThread = true;
+    m_renderThread.join();
+}
+
+//----------------------------------------------------
+
+const float*    CRenderer::AcquireFrame()
+{
+    if (m_frontBuffer == nullptr)
+        return nullptr;
+
+    std::lock_guard<std::mutex>     lock(m_frameMutex);
+    if (m_hasNewFrame)
+    {
+        std::swap(m_frontBuffer, m_readyBuffer);
+        m_hasNewFrame = false;
     }
+    // nothing published yet: the front buffer still holds zeros (black)
+    return m_frontBuffer.get();
 }
 
 //----------------------------------------------------
@@ -130,11 +224,26 @@ void    CRenderer::GetLastRender(float* &outMap)
 void    CRenderer::SetRenderSetting(const SRenderSetting &renderSetting)
 {
     m_renderSetting = renderSetting;
+
+    // (re)spawn workers only when the thread layout actually changes
+    u_int32_t   nThreads = m_renderSetting.nThreads;
+    if (nThreads == 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (m_threadPool == nullptr ||
+        m_threadPool->GetThreadCount() != nThreads ||
+        m_threadPool->IsPinned() != m_renderSetting.pinThreads)
+    {
+        m_threadPool = std::make_unique<CThreadPool>(nThreads, m_renderSetting.pinThreads);
+        m_workerCounters = std::vector<SWorkerCounter>(nThreads);
+    }
+
+    _BuildTiles();
+    _AssignTileWorkers();
 }
 
 //----------------------------------------------------
 
-void    CRenderer::InitScene()
+void    CRenderer::InitScene(const char* meshFile)
 {
         // Camera
     float           aspectRatio = (float)m_renderSetting.render_w / m_renderSetting.render_h;
@@ -158,10 +267,32 @@ void    CRenderer::InitScene()
     std::shared_ptr<cr::IMaterial>  mat_glass = std::make_shared<cr::CMaterialGlass>(1.9, 0);
 
 
+    // bvh-trees are built on the worker pool unless a serial build is asked for
+    CThreadPool     *buildPool = m_renderSetting.parallelBvhBuild ? m_threadPool.get() : nullptr;
+
 #if 1   // Use Obj
     auto croissant = std::make_shared<cr::CHittableMesh>(glm::vec3(0, 0, 0), mat_lambertBrown);
-    croissant->Load("Model/Croissants_obj/Croissant.obj");
+    croissant->Load(meshFile, buildPool, m_renderSetting.meshPartition, m_renderSetting.meshCache,
+                    m_renderSetting.restructureBvh);
     m_scene->Add(croissant);
+
+    // instances only store a transform, every one traces the same mesh
+    const std::shared_ptr<cr::IMaterial>    instanceMaterials[] = { mat_lambertBrown, mat_metalGold, mat_lambertWhiteGray, mat_metalRose };
+    cr::CRandom     rng(0x5eed);
+    for (u_int32_t i = 0; i < m_renderSetting.nMeshInstances; i++)
+    {
+        // on the ground sphere, outside the spheres around the origin
+        float   r = 0.9f + 3.1f * glm::sqrt(rng.NextFloat());
+        float   phi = glm::two_pi<float>() * rng.NextFloat();
+        float   drop = glm::sqrt(100.f - r * r) - 10.f;
+
+        glm::mat4   transform = glm::translate(glm::mat4(1.f), glm::vec3(r * glm::cos(phi), drop, r * glm::sin(phi)));
+        transform = glm::rotate(transform, glm::two_pi<float>() * rng.NextFloat(), glm::vec3(0, 1, 0));
+        transform = glm::scale(transform, glm::vec3(0.35f + 0.3f * rng.NextFloat()));
+
+        const std::shared_ptr<cr::IMaterial>    &material = instanceMaterials[rng.NextUInt() % 4];
+        m_scene->Add(std::make_shared<cr::CHittableInstance>(croissant, transform, material));
+    }
 #else
     m_scene.Add(std::make_shared<cr::CHittableSphere>(cr::CHittableSphere(glm::vec3(0, 0, 0), 0.1, mat_lambertWhite)));
 #endif
@@ -172,12 +303,23 @@ void    CRenderer::InitScene()
     m_scene->Add(std::make_shared<cr::CHittableSphere>(cr::CHittableSphere(glm::vec3(-0.155, 0.06, 0.23), 0.11, mat_metalBlue)));
     m_scene->Add(std::make_shared<cr::CHittableSphere>(cr::CHittableSphere(glm::vec3(0, -10.05, 0), 10, mat_labmbertChecker)));
 
-    m_scene->BuildBVHTree();
+    m_scene->BuildBVHTree(buildPool, cr::CBVHAccel::SAH, m_renderSetting.restructureBvh);
+
+    // before replicating, so the copies are compressed too
+    if (m_renderSetting.compressBvh)
+        m_scene->CompressBVH();
+
+    if (m_renderSetting.replicateScene)
+    {
+        u_int32_t   nNodes = m_threadPool->GetNodeCount();
+        printf("[Render] Replicating scene data on %u NUMA node(s)\n", nNodes);
+        m_scene->ReplicateNuma(nNodes);
+    }
 }
 
 //----------------------------------------------------
 
-glm::vec3   CRenderer::_RecursiveRaycast(const CRay &ray, int depth)
+glm::vec3   CRenderer::_RecursiveRaycast(const CRay &ray, int depth, int maxDepth, uint64_t pathSeed) const
 {
     // max-depth reached
     if (depth <= 0) {
@@ -190,8 +332,9 @@ glm::vec3   CRenderer::_RecursiveRaycast(const CRay &ray, int depth)
         // bounced rays
         cr::CRay    scatteredRay;
         glm::vec3   attenuation;
-        if (hitRec.p_material->Scatter(ray, hitRec, attenuation, scatteredRay))
-            return attenuation * _RecursiveRaycast(scatteredRay, depth - 1);
+        cr::CRandom rng(pathSeed, maxDepth - depth);
+        if (hitRec.p_material->Scatter(ray, hitRec, attenuation, scatteredRay, rng))
+            return attenuation * _RecursiveRaycast(scatteredRay, depth - 1, maxDepth, pathSeed);
         return glm::vec3(0);
     }
 
@@ -202,14 +345,312 @@ glm::vec3   CRenderer::_RecursiveRaycast(const CRay &ray, int depth)
 
 //----------------------------------------------------
 
+void    CRenderer::_BeginRender()
+{
+    if (m_pixmap == nullptr)    // initial render
+    {
+        _AllocPixmap();
+        u_int32_t   sampleEnd;
+        GetSampleRange(m_renderSetting, m_currentSample, sampleEnd);
+    }
+    else if (m_isFinished)      // previous render exists
+        _ClearOldRender();
+}
+
+//----------------------------------------------------
+
+void    CRenderer::GetSampleRange(const SRenderSetting &setting, u_int32_t &sampleBegin, u_int32_t &sampleEnd)
+{
+    sampleEnd = setting.sampleEnd > 0 ? setting.sampleEnd : setting.nSamples;
+    sampleBegin = std::min(setting.sampleBegin, sampleEnd);
+}
+
+//----------------------------------------------------
+
 void    CRenderer::_ClearOldRender()
 {
+    u_int32_t   sampleEnd;
+    GetSampleRange(m_renderSetting, m_currentSample, sampleEnd);
     m_isFinished = false;
-    m_currentSample = 0;
+    m_currentTile = 0;
+    std::fill(m_tileSamples.begin(), m_tileSamples.end(), 0);
 
     for (int i = 0; i < m_renderSetting.render_w * m_renderSetting.render_h * 3; ++i)
         m_pixmap[i] = 0.0f;
 }
 
+//----------------------------------------------------
+
+void    CRenderer::_Resolve(float *outMap) const
+{
+    // tiles may hold different sample counts in the middle of a pass
+    for (size_t t = 0; t < m_tiles.size(); t++)
+    {
+        const STile     &tile = m_tiles[t];
+        const float     scale = m_tileSamples[t] > 0 ? 1.0f / m_tileSamples[t] : 0.f;
+
+        for (size_t h = tile.y0; h < tile.y1; h++)
+        {
+            size_t  rowBegin = (h * m_renderSetting.render_w + tile.x0) * 3;
+            ToneMap(&m_pixmap[rowBegin], &outMap[rowBegin], (tile.x1 - tile.x0) * 3, scale);
+        }
+    }
+}
+
+//----------------------------------------------------
+
+void    CRenderer::ToneMap(const float *accum, float *outMap, size_t count, float scale)
+{
+    // gamma correction
+    for (size_t i = 0; i < count; i++)
+        outMap[i] = glm::sqrt(accum[i] * scale);
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_RenderThreadLoop()
+{
+    while (!m_stopRenderThread && !m_isFinished)
+    {
+        if (m_renderSetting.frameBudgetMs > 0.f)
+            ProgressiveRender(m_renderSetting.frameBudgetMs);
+        else
+            ProgressiveRender();
+        _Resolve(m_backBuffer.get());
+
+        // publish: the finished back buffer becomes the ready one
+        std::lock_guard<std::mutex>     lock(m_frameMutex);
+        std::swap(m_backBuffer, m_readyBuffer);
+        m_hasNewFrame = true;
+    }
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_BuildTiles()
+{
+    BuildTiles(m_renderSetting, m_tiles, m_pixelOrder);
+
+    m_tileSamples.assign(m_tiles.size(), 0);
+    m_currentTile = 0;
+}
+
+//----------------------------------------------------
+
+void    CRenderer::BuildTiles(const SRenderSetting &setting, std::vector<STile> &tiles, std::vector<glm::u16vec2> &pixelOrder)
+{
+    const u_int32_t     tileSize = std::max(1u, setting.tileSize);
+    const EPixelOrder   order = setting.pixelOrder;
+
+    // index along the chosen curve, on a n x n grid (n a power of two)
+    auto    curveIndex = [order](u_int32_t n, u_int32_t x, u_int32_t y) -> u_int32_t {
+        switch (order)
+        {
+        case MORTON:    return MortonEncode2D(x, y);
+        case HILBERT:   return HilbertEncode2D(n, x, y);
+        case SCANLINE:
+        default:        return y * n + x;
+        }
+    };
+    auto    ceilPow2 = [](u_int32_t x) { u_int32_t n = 1; while (n < x) n <<= 1; return n; };
+
+    // tiles
+    const u_int32_t     nTilesX = (setting.render_w + tileSize - 1) / tileSize;
+    const u_int32_t     nTilesY = (setting.render_h + tileSize - 1) / tileSize;
+    const u_int32_t     tileGrid = order == SCANLINE ? nTilesX : ceilPow2(std::max(nTilesX, nTilesY));
+
+    std::vector<std::pair<u_int32_t, STile>>    keyedTiles;
+    for (u_int32_t ty = 0; ty < nTilesY; ty++) {
+        for (u_int32_t tx = 0; tx < nTilesX; tx++)
+        {
+            u_int32_t   x = tx * tileSize;
+            u_int32_t   y = ty * tileSize;
+            STile       tile = { x, y,
+                                 std::min(x + tileSize, setting.render_w),
+                                 std::min(y + tileSize, setting.render_h) };
+            keyedTiles.push_back({ curveIndex(tileGrid, tx, ty), tile });
+        }
+    }
+    std::stable_sort(keyedTiles.begin(), keyedTiles.end(),
+                     [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    tiles.clear();
+    for (const auto &keyedTile : keyedTiles)
+        tiles.push_back(keyedTile.second);
+
+    // pixels within a tile, edge tiles skip the offsets outside of them
+    const u_int32_t     pixelGrid = order == SCANLINE ? tileSize : ceilPow2(tileSize);
+
+    std::vector<std::pair<u_int32_t, glm::u16vec2>>     keyedPixels;
+    for (u_int32_t y = 0; y < tileSize; y++)
+        for (u_int32_t x = 0; x < tileSize; x++)
+            keyedPixels.push_back({ curveIndex(pixelGrid, x, y), glm::u16vec2(x, y) });
+    std::stable_sort(keyedPixels.begin(), keyedPixels.end(),
+                     [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    pixelOrder.clear();
+    for (const auto &keyedPixel : keyedPixels)
+        pixelOrder.push_back(keyedPixel.second);
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_RenderTile(const STile &tile, u_int32_t sampleBegin, u_int32_t sampleEnd)
+{
+    uint64_t    nSamples = RenderTile(*m_camera, m_renderSetting, m_pixelOrder, tile, sampleBegin, sampleEnd, m_pixmap);
+
+    int     worker = m_threadPool->GetCurrentWorker();
+    if (worker >= 0)
+        m_workerCounters[worker].nSamples += nSamples;
+}
+
+//----------------------------------------------------
+
+uint64_t    CRenderer::RenderTile(const CCamera &camera, const SRenderSetting &setting, const std::vector<glm::u16vec2> &pixelOrder,
+                                  const STile &tile, u_int32_t sampleBegin, u_int32_t sampleEnd, float *pixmap) const
+{
+    uint64_t    nSamples = 0;
+
+    // tiles never overlap, so each pixel is written by exactly one thread
+    for (const glm::u16vec2 &offset : pixelOrder)
+    {
+        const size_t    w = tile.x0 + offset.x;
+        const size_t    h = tile.y0 + offset.y;
+        if (w >= tile.x1 || h >= tile.y1)
+            continue;
+
+        glm::vec3   color(0.f);
+        for (size_t s = sampleBegin; s < sampleEnd; s++)
+        {
+            int     si = s % setting.nSamplesW;
+            int     sj = s / setting.nSamplesW;
+            float   u = (w + (float)si / setting.nSamplesW + setting.nSamplesOffset) / setting.render_w;
+            float   v = (h + (float)sj / setting.nSamplesW + setting.nSamplesOffset) / setting.render_h;
+            CRay        ray = camera.GetRay(u, v);
+            uint64_t    pathSeed = CRandom::Hash(h * setting.render_w + w, s);
+            color += _RecursiveRaycast(ray, setting.nMaxDepth, setting.nMaxDepth, pathSeed);
+        }
+        nSamples += sampleEnd - sampleBegin;
+
+        pixmap[(h * setting.render_w + w) * 3 + 0] += color.r;
+        pixmap[(h * setting.render_w + w) * 3 + 1] += color.g;
+        pixmap[(h * setting.render_w + w) * 3 + 2] += color.b;
+    }
+
+    return nSamples;
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_RenderTilesParallel(size_t tileBegin, size_t tileEnd, u_int32_t sampleBegin, u_int32_t sampleEnd)
+{
+    for (size_t t = tileBegin; t < tileEnd; t++)
+    {
+        const STile     &tile = m_tiles[t];
+        m_threadPool->Submit([this, tile, sampleBegin, sampleEnd] { _RenderTile(tile, sampleBegin, sampleEnd); },
+                             m_tileWorkers[t]);
+    }
+
+    m_threadPool->Wait();
+
+    for (size_t t = tileBegin; t < tileEnd; t++)
+        m_tileSamples[t] += sampleEnd - sampleBegin;
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_AdvancePass()
+{
+    m_currentTile = 0;
+
+    u_int32_t   sampleBegin, sampleEnd;
+    GetSampleRange(m_renderSetting, sampleBegin, sampleEnd);
+    if (++m_currentSample >= sampleEnd)
+    {
+        m_isFinished = true;
+        printf("[Render] Done.\n");
+    }
+    else
+    {
+        printf("[Render] Progress: %.2f%%\n", 100.f * (m_currentSample - sampleBegin) / (sampleEnd - sampleBegin));
+    }
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_AllocPixmap()
+{
+    const size_t    size = m_renderSetting.render_w * m_renderSetting.render_h * 3;
+
+    if (!m_threadPool->IsPinned())
+    {
+        m_pixmap = new float[size]();
+        return;
+    }
+
+    // first touch: pages land on the node of the thread that writes them
+    // first, so let each tile's home worker zero its own rows
+    m_pixmap = new float[size];
+    for (size_t t = 0; t < m_tiles.size(); t++)
+    {
+        const STile     tile = m_tiles[t];
+        m_threadPool->Submit([this, tile] {
+            for (size_t h = tile.y0; h < tile.y1; h++)
+                std::fill(&m_pixmap[(h * m_renderSetting.render_w + tile.x0) * 3],
+                          &m_pixmap[(h * m_renderSetting.render_w + tile.x1) * 3], 0.f);
+        }, m_tileWorkers[t], false);
+    }
+    m_threadPool->Wait();
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_AssignTileWorkers()
+{
+    m_tileWorkers.assign(m_tiles.size(), -1);
+    if (!m_threadPool->IsPinned())
+        return;
+
+    // workers per node
+    const u_int32_t                 nNodes = m_threadPool->GetNodeCount();
+    std::vector<std::vector<int>>   nodeWorkers(nNodes);
+    for (u_int32_t i = 0; i < m_threadPool->GetThreadCount(); i++)
+        nodeWorkers[m_threadPool->GetWorkerNode(i)].push_back(i);
+
+    // pages span whole framebuffer rows, so each node owns a horizontal band
+    // of the image and its workers share the tiles in that band
+    std::vector<size_t>     nextWorker(nNodes, 0);
+    for (size_t t = 0; t < m_tiles.size(); t++)
+    {
+        u_int32_t   node = (u_int32_t)((uint64_t)m_tiles[t].y0 * nNodes / m_renderSetting.render_h);
+        const std::vector<int>  &workers = nodeWorkers[node];
+        m_tileWorkers[t] = workers[nextWorker[node]++ % workers.size()];
+    }
+}
+
+//----------------------------------------------------
+
+void    CRenderer::_PrintNodeThroughput(float elapsedMs) const
+{
+    if (elapsedMs <= 0.f)
+        return;
+
+    const u_int32_t         nNodes = m_threadPool->GetNodeCount();
+    std::vector<uint64_t>   nodeSamples(nNodes, 0);
+    std::vector<u_int32_t>  nodeThreads(nNodes, 0);
+    for (u_int32_t i = 0; i < m_threadPool->GetThreadCount(); i++)
+    {
+        nodeSamples[m_threadPool->GetWorkerNode(i)] += m_workerCounters[i].nSamples;
+        nodeThreads[m_threadPool->GetWorkerNode(i)]++;
+    }
+
+    for (u_int32_t node = 0; node < nNodes; node++)
+    {
+        double  samplesPerSec = nodeSamples[node] / (elapsedMs / 1000.0);
+        printf("[Render] Node %u: %u threads, %.3f Msamples/s (%.3f per thread)\n",
+               node, nodeThreads[node], samplesPerSec / 1e6, samplesPerSec / 1e6 / nodeThreads[node]);
+    }
+}
+
 //----------------------------------------------------
 _CR_NAMESPACE_END
@@ -2,12 +2,25 @@
 
 #include "common.h"
 #include "ray.h"
+#include "bvh.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 _CR_NAMESPACE_BEGIN
 //----------------------------------------------------
 
 class CHittableList;
 class CCamera;
+class CThreadPool;
+struct SAccumulation;
+
+//----------------------------------------------------
+
+// order in which tiles, and pixels within a tile, are traced. Curve orders
+// keep consecutive rays close on screen so they reuse cached BVH nodes.
+enum EPixelOrder { SCANLINE, MORTON, HILBERT };
 
 //----------------------------------------------------
 
@@ -20,6 +33,51 @@ struct SRenderSetting
     // AA
     u_int32_t   nSamplesW;
     float       nSamplesOffset;
+
+    // multithreading
+    u_int32_t   nThreads = 0;       // 0 -> all hardware threads
+    u_int32_t   tileSize = 32;      // tile edge in pixels
+    EPixelOrder pixelOrder = HILBERT;
+
+    // NUMA, pin workers to cpus and give each tile a home worker that
+    // first-touches its part of the framebuffer. "replicateScene" also copies
+    // the read-only BVH data to every node.
+    bool        pinThreads = false;
+    bool        replicateScene = false;
+
+    // build the bvh-trees on the worker pool, off -> serial reference build
+    bool        parallelBvhBuild = true;
+    // bvh-tree builder of the loaded mesh, the scene itself stays SAH
+    CBVHAccel::EPartitionType   meshPartition = CBVHAccel::SAH;
+    // memory map the mesh and its bvh-tree from a cache next to the obj
+    bool        meshCache = false;
+    // 8-bit quantized bvh-tree nodes, half the traversal memory traffic
+    bool        compressBvh = false;
+    // treelet restructuring after the bvh-tree builds, slower builds for
+    // faster traversal of static scenes
+    bool        restructureBvh = false;
+    // extra copies of the mesh scattered around, as instances sharing its
+    // bvh-tree (two-level bvh)
+    u_int32_t   nMeshInstances = 0;
+
+    // Renders only trace samples [sampleBegin, sampleEnd) of the
+    // "nSamples" per pixel (0 -> up to nSamples), so several machines can
+    // each add a disjoint range to the same frame, see SAccumulation
+    u_int32_t   sampleBegin = 0;
+    u_int32_t   sampleEnd = 0;
+
+    // progressive rendering, time budget per ProgressiveRender call used by
+    // the render thread (0 -> one full sample pass per call)
+    float       frameBudgetMs = 0.f;
+};
+
+//----------------------------------------------------
+
+// screen-space rectangle [x0, x1) x [y0, y1), the unit of work per thread
+struct STile
+{
+    u_int32_t   x0, y0;
+    u_int32_t   x1, y1;
 };
 
 //----------------------------------------------------
@@ -28,29 +86,101 @@ class CRenderer
 {
 public:
     CRenderer();
+    ~CRenderer();
 
     void    FullRender();
     void    ProgressiveRender();
+    // Render as many tiles as fit in "budgetMs", then return. The next call
+    // continues where this one stopped, the batch size adapts to the
+    // measured tile throughput.
+    void    ProgressiveRender(float budgetMs);
     void    GetLastRender(float* &outMap);
+    // raw sums and per-pixel sample counts of the current render
+    void    GetAccumulation(SAccumulation &acc) const;
 
     void    SetRenderSetting(const SRenderSetting &renderSetting);
-    void    InitScene();
+    void    InitScene(const char* meshFile = "Model/Croissants_obj/Croissant.obj");
 
     bool    IsFinished() { return m_isFinished; };
 
+    // Background rendering: progressive passes (or budgeted slices of them,
+    // see "frameBudgetMs") run on a dedicated thread and each one is
+    // published as a display-ready (gamma corrected) frame. AcquireFrame()
+    // only swaps buffers, so the caller never waits on path tracing. Returns
+    // the latest frame, a black one until the first is published, or nullptr
+    // if the render thread was never started.
+    void            StartRenderThread();
+    void            StopRenderThread();
+    const float*    AcquireFrame();
+
+    // Low-level access for schedulers that render their own images against
+    // the loaded scene (see CRenderQueue). RenderTile accumulates samples
+    // [sampleBegin, sampleEnd) of the tile into "pixmap" and returns the
+    // number of samples traced.
+    uint64_t        RenderTile(const CCamera &camera, const SRenderSetting &setting, const std::vector<glm::u16vec2> &pixelOrder,
+                               const STile &tile, u_int32_t sampleBegin, u_int32_t sampleEnd, float *pixmap) const;
+    CThreadPool&    GetThreadPool() { return *m_threadPool; }
+    const CCamera&  GetCamera() const { return *m_camera; }
+
+    // split the image into tiles and the per-tile pixel order of "setting"
+    static void     BuildTiles(const SRenderSetting &setting, std::vector<STile> &tiles, std::vector<glm::u16vec2> &pixelOrder);
+    // average "scale"-weighted accumulation and gamma correct, "count" floats
+    static void     ToneMap(const float *accum, float *outMap, size_t count, float scale);
+    // samples [sampleBegin, sampleEnd) a render of "setting" traces
+    static void     GetSampleRange(const SRenderSetting &setting, u_int32_t &sampleBegin, u_int32_t &sampleEnd);
+
 private:
-    glm::vec3   _RecursiveRaycast(const CRay &ray, int depth);
+    // "pathSeed" identifies (pixel, sample), each bounce draws from its own
+    // random stream of that seed
+    glm::vec3   _RecursiveRaycast(const CRay &ray, int depth, int maxDepth, uint64_t pathSeed) const;
+    // pixmap for a new render, progressive passes restart at "sampleBegin"
+    void        _BeginRender();
     void        _ClearOldRender();
+    void        _Resolve(float *outMap) const;
+    void        _RenderThreadLoop();
+    void        _BuildTiles();
+    void        _RenderTile(const STile &tile, u_int32_t sampleBegin, u_int32_t sampleEnd);
+    void        _RenderTilesParallel(size_t tileBegin, size_t tileEnd, u_int32_t sampleBegin, u_int32_t sampleEnd);
+    void        _AdvancePass();
+    void        _AllocPixmap();
+    void        _AssignTileWorkers();
+    void        _PrintNodeThroughput(float elapsedMs) const;
 
 private:
     std::shared_ptr<CHittableList>  m_scene;
     std::shared_ptr<CCamera>        m_camera;
 
     SRenderSetting                  m_renderSetting;
-    bool                            m_isFinished;
+    std::atomic<bool>               m_isFinished;
     u_int32_t                       m_currentSample;    // for progressive rendering
+    size_t                          m_currentTile;      // next tile of the current pass
+    float                           m_msPerTile;        // measured wall time of one tile per thread, 0 if unknown
 
     float*                          m_pixmap;
+
+    // multithreading
+    std::unique_ptr<CThreadPool>    m_threadPool;
+    std::vector<STile>              m_tiles;
+    std::vector<u_int32_t>          m_tileSamples;      // accumulated samples per tile
+    std::vector<glm::u16vec2>       m_pixelOrder;       // pixel offsets within a full tile, in visiting order
+    std::vector<int>                m_tileWorkers;      // home worker per tile, -1 -> any
+
+    // per worker sample counter, padded to avoid false sharing
+    struct alignas(64) SWorkerCounter
+    {
+        uint64_t    nSamples = 0;
+    };
+    std::vector<SWorkerCounter>     m_workerCounters;
+
+    // background rendering, the render thread writes "m_backBuffer" and hands
+    // it over through "m_readyBuffer", the UI thread owns "m_frontBuffer"
+    std::thread                     m_renderThread;
+    std::atomic<bool>               m_stopRenderThread;
+    std::mutex                      m_frameMutex;
+    std::unique_ptr<float[]>        m_backBuffer;
+    std::unique_ptr<float[]>        m_readyBuffer;
+    std::unique_ptr<float[]>        m_frontBuffer;
+    bool                            m_hasNewFrame;
 };
 
 //----------------------------------------------------
@@ -0,0 +1,323 @@
+#include "thread_pool.h"
+#include "topology.h"
+
+#include <chrono>   // steady_clock
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+static thread_local const CThreadPool   *t_workerPool = nullptr;
+static thread_local int                 t_workerIndex = -1;
+
+//----------------------------------------------------
+
+CThreadPool::CThreadPool(u_int32_t nThreads, bool pinThreads)
+: m_nNodes(1)
+, m_isPinned(pinThreads)
+, m_queued(0)
+, m_pending(0)
+, m_nextQueue(0)
+, m_stop(false)
+{
+    if (nThreads == 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (u_int32_t i = 0; i < nThreads; i++)
+        m_workers.push_back(std::make_unique<SWorker>());
+
+    // spread workers round-robin over the nodes, so a partial pool still
+    // uses the memory bandwidth of every socket
+    if (m_isPinned)
+    {
+        const CCpuTopology  &topology = CCpuTopology::Get();
+        m_nNodes = std::min(nThreads, topology.GetNodeCount());
+
+        for (u_int32_t i = 0; i < nThreads; i++)
+        {
+            const int               node = i % m_nNodes;
+            const std::vector<int>  &cpus = topology.GetNodeCpus(node);
+            m_workers[i]->node = node;
+            m_workers[i]->cpu = cpus[(i / m_nNodes) % cpus.size()];
+        }
+    }
+
+    // start threads only after every worker slot exists, since workers steal
+    // from each other right away
+    for (u_int32_t i = 0; i < nThreads; i++)
+        m_workers[i]->thread = std::thread(&CThreadPool::_WorkerLoop, this, (int)i);
+}
+
+//----------------------------------------------------
+
+CThreadPool::~CThreadPool()
+{
+    Wait();
+
+    {
+        std::lock_guard<std::mutex>     lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_wakeCond.notify_all();
+
+    for (auto &worker : m_workers)
+        worker->thread.join();
+}
+
+//----------------------------------------------------
+
+void    CThreadPool::Submit(TTask task, int worker, bool stealable)
+{
+    // tasks spawned by a worker stay local (depth-first), others go round-robin
+    int     index = worker >= 0 ? worker : GetCurrentWorker();
+    if (index < 0)
+        index = m_nextQueue++ % m_workers.size();
+
+    // count the task before it becomes visible, so a thief never drops the
+    // queued counter below zero
+    m_pending++;
+    {
+        std::lock_guard<std::mutex>     lock(m_sleepMutex);
+        m_queued++;
+    }
+    {
+        std::lock_guard<std::mutex>     lock(m_workers[index]->mutex);
+        if (stealable)
+            m_workers[index]->tasks.push_back(std::move(task));
+        else
+            m_workers[index]->pinnedTasks.push_back(std::move(task));
+    }
+
+    // a pinned task must wake its owner, which notify_one can't target
+    if (stealable)
+        m_wakeCond.notify_one();
+    else
+        m_wakeCond.notify_all();
+}
+
+//----------------------------------------------------
+
+void    CThreadPool::Wait()
+{
+    std::unique_lock<std::mutex>    lock(m_sleepMutex);
+    m_doneCond.wait(lock, [this] { return m_pending == 0; });
+}
+
+//----------------------------------------------------
+
+void    CThreadPool::ResetStats()
+{
+    for (auto &worker : m_workers)
+        worker->stats = SWorkerStats();
+}
+
+//----------------------------------------------------
+
+std::vector<CThreadPool::SWorkerStats>  CThreadPool::GetStats() const
+{
+    std::vector<SWorkerStats>   stats;
+    stats.reserve(m_workers.size());
+    for (const auto &worker : m_workers)
+        stats.push_back(worker->stats);
+
+    return stats;
+}
+
+//----------------------------------------------------
+
+int     CThreadPool::GetCurrentWorker() const
+{
+    return t_workerPool == this ? t_workerIndex : -1;
+}
+
+//----------------------------------------------------
+
+bool    CThreadPool::RunPendingTask()
+{
+    const int   index = GetCurrentWorker();
+
+    TTask   task;
+    if (index >= 0)
+    {
+        if (!_Pop(index, task) && !_Steal(index, task))
+            return false;
+    }
+    else
+    {
+        // outside threads have no queue of their own, take from anyone
+        size_t  victim = 0;
+        for (; victim < m_workers.size(); victim++)
+        {
+            if (_TryStealFrom(index, victim, task))
+                break;
+        }
+        if (victim == m_workers.size())
+            return false;
+    }
+
+    _Execute(index, task);
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CThreadPool::_WorkerLoop(int index)
+{
+    t_workerPool = this;
+    t_workerIndex = index;
+
+    const SWorker   &worker = *m_workers[index];
+    if (worker.cpu >= 0)
+        CCpuTopology::PinCurrentThread(worker.cpu);
+    CCpuTopology::SetCurrentNode(worker.node);
+
+    TTask   task;
+    while (true)
+    {
+        if (_Pop(index, task) || _Steal(index, task))
+        {
+            _Execute(index, task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex>    lock(m_sleepMutex);
+        m_wakeCond.wait(lock, [this] { return m_queued > 0 || m_stop; });
+        if (m_stop && m_queued == 0)
+            break;
+    }
+}
+
+//----------------------------------------------------
+
+bool    CThreadPool::_Pop(int index, TTask &task)
+{
+    SWorker     &worker = *m_workers[index];
+    std::lock_guard<std::mutex>     lock(worker.mutex);
+
+    if (!worker.pinnedTasks.empty())
+    {
+        task = std::move(worker.pinnedTasks.front());
+        worker.pinnedTasks.pop_front();
+        m_queued--;
+
+        return true;
+    }
+
+    if (worker.tasks.empty())
+        return false;
+
+    // LIFO for the owner keeps recently spawned work hot in cache
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    m_queued--;
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CThreadPool::_Steal(int index, TTask &task)
+{
+    const size_t    nWorkers = m_workers.size();
+    const int       node = m_workers[index]->node;
+
+    // steal from the own NUMA node first, remote memory is the last resort
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t i = 1; i < nWorkers; i++)
+        {
+            int     victim = (index + i) % nWorkers;
+            if ((m_workers[victim]->node == node) != (pass == 0))
+                continue;
+            if (_TryStealFrom(index, victim, task))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+//----------------------------------------------------
+
+bool    CThreadPool::_TryStealFrom(int index, int victim, TTask &task)
+{
+    SWorker     &victimWorker = *m_workers[victim];
+    std::lock_guard<std::mutex>     lock(victimWorker.mutex);
+
+    if (victimWorker.tasks.empty())
+        return false;
+
+    // FIFO for thieves takes the oldest (typically largest) work
+    task = std::move(victimWorker.tasks.front());
+    victimWorker.tasks.pop_front();
+    m_queued--;
+    if (index >= 0)
+        m_workers[index]->stats.nSteals++;
+
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CThreadPool::_Execute(int index, TTask &task)
+{
+    auto    begin = std::chrono::steady_clock::now();
+    task();
+    auto    end = std::chrono::steady_clock::now();
+
+    if (index >= 0)
+    {
+        SWorkerStats    &stats = m_workers[index]->stats;
+        stats.busyMs += std::chrono::duration<double, std::milli>(end - begin).count();
+        stats.nTasks++;
+    }
+
+    task = nullptr;
+
+    if (--m_pending == 0)
+    {
+        std::lock_guard<std::mutex>     lock(m_sleepMutex);
+        m_doneCond.notify_all();
+    }
+}
+
+//----------------------------------------------------
+
+CTaskGroup::CTaskGroup(CThreadPool &pool)
+: m_pool(pool)
+, m_pending(0)
+{
+}
+
+//----------------------------------------------------
+
+CTaskGroup::~CTaskGroup()
+{
+    Wait();
+}
+
+//----------------------------------------------------
+
+void    CTaskGroup::Run(CThreadPool::TTask task)
+{
+    m_pending++;
+    m_pool.Submit([this, task = std::move(task)] {
+        task();
+        m_pending--;
+    });
+}
+
+//----------------------------------------------------
+
+void    CTaskGroup::Wait()
+{
+    // our own tasks sit on top of the local deque, so helping usually runs
+    // them right here; otherwise they were stolen and we run something else
+    while (m_pending > 0)
+    {
+        if (!m_pool.RunPendingTask())
+            std::this_thread::yield();
+    }
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
@@ -0,0 +1,131 @@
+#pragma once
+
+/*************************************************************************
+*
+*		thread_pool.h
+*
+*		Persistent worker pool with per-worker task deques. Owners
+*		pop their own tasks from the back, idle workers steal from
+*		the front of other deques, so uneven tasks (e.g. heavy
+*		render tiles) get balanced automatically.
+*
+*		Optionally workers are pinned to cpus, spread round-robin
+*		over the NUMA nodes, and thieves prefer victims on their
+*		own node.
+*
+*		CTaskGroup adds nested fork-join on top: waiting on a group
+*		executes other queued tasks instead of blocking, so it is
+*		safe inside tasks (e.g. recursive BVH construction).
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CThreadPool
+{
+public:
+    using TTask = std::function<void()>;
+
+    struct SWorkerStats
+    {
+        double      busyMs = 0.0;   // time spent executing tasks
+        uint64_t    nTasks = 0;
+        uint64_t    nSteals = 0;    // tasks taken from other workers
+    };
+
+public:
+    // nThreads = 0 uses all hardware threads
+    explicit CThreadPool(u_int32_t nThreads = 0, bool pinThreads = false);
+    ~CThreadPool();
+
+    CThreadPool(const CThreadPool&) = delete;
+    CThreadPool&    operator= (const CThreadPool&) = delete;
+
+    // "worker" picks the target queue (-1 -> automatic). Non-stealable tasks
+    // always run on that worker, e.g. first-touch memory initialization.
+    void        Submit(TTask task, int worker = -1, bool stealable = true);
+    // Block until every submitted task is finished. Must not be called from
+    // inside a task.
+    void        Wait();
+
+    u_int32_t   GetThreadCount() const { return (u_int32_t)m_workers.size(); }
+    u_int32_t   GetNodeCount() const { return m_nNodes; }
+    int         GetWorkerNode(int worker) const { return m_workers[worker]->node; }
+    bool        IsPinned() const { return m_isPinned; }
+    void        ResetStats();
+    std::vector<SWorkerStats>   GetStats() const;
+
+    // index of the calling thread among the workers of this pool, -1 for
+    // any other thread (including workers of another pool)
+    int         GetCurrentWorker() const;
+
+    // Execute one queued task on the calling thread, own queue first.
+    // Returns false if there was nothing to run.
+    bool        RunPendingTask();
+
+private:
+    struct SWorker
+    {
+        std::deque<TTask>   tasks;
+        std::deque<TTask>   pinnedTasks;    // never stolen
+        std::mutex          mutex;
+        std::thread         thread;
+        SWorkerStats        stats;
+        int                 node = 0;
+        int                 cpu = -1;       // -1 -> not pinned
+    };
+
+    void        _WorkerLoop(int index);
+    bool        _TryStealFrom(int index, int victim, TTask &task);
+    bool        _Pop(int index, TTask &task);
+    bool        _Steal(int index, TTask &task);
+    void        _Execute(int index, TTask &task);
+
+private:
+    std::vector<std::unique_ptr<SWorker>>   m_workers;
+    u_int32_t                               m_nNodes;
+    bool                                    m_isPinned;
+
+    std::mutex                  m_sleepMutex;
+    std::condition_variable     m_wakeCond;     // signals queued tasks
+    std::condition_variable     m_doneCond;     // signals pending == 0
+
+    std::atomic<u_int32_t>      m_queued;       // tasks sitting in deques
+    std::atomic<u_int32_t>      m_pending;      // tasks not finished yet
+    std::atomic<u_int32_t>      m_nextQueue;    // round-robin submit target
+    std::atomic<bool>           m_stop;
+};
+
+//----------------------------------------------------
+
+class CTaskGroup
+{
+public:
+    explicit CTaskGroup(CThreadPool &pool);
+    ~CTaskGroup();
+
+    CTaskGroup(const CTaskGroup&) = delete;
+    CTaskGroup&     operator= (const CTaskGroup&) = delete;
+
+    void    Run(CThreadPool::TTask task);
+    // Help executing pool tasks until every task of this group is finished.
+    // Unlike CThreadPool::Wait, this may be called from inside a task.
+    void    Wait();
+
+private:
+    CThreadPool                 &m_pool;
+    std::atomic<u_int32_t>      m_pending;
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
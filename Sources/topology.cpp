@@ -0,0 +1,162 @@
+#include "topology.h"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>    // MPOL_BIND
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+static thread_local int     t_numaNode = 0;
+
+//----------------------------------------------------
+
+// parse sysfs cpu and node lists such as "0-3,8-11"
+static std::vector<int>     _ParseCpuList(const std::string &list)
+{
+    std::vector<int>    cpus;
+    std::stringstream   ss(list);
+    std::string         range;
+
+    while (std::getline(ss, range, ','))
+    {
+        if (range.empty())
+            continue;
+
+        size_t  dash = range.find('-');
+        int     first = std::stoi(range.substr(0, dash));
+        int     last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+//----------------------------------------------------
+
+CCpuTopology::CCpuTopology()
+{
+#if defined(__linux__)
+    std::ifstream   online("/sys/devices/system/node/online");
+    std::string     nodeList;
+    if (online && std::getline(online, nodeList))
+    {
+        for (int nodeId : _ParseCpuList(nodeList))
+        {
+            std::ifstream   file("/sys/devices/system/node/node" + std::to_string(nodeId) + "/cpulist");
+            std::string     list;
+            if (!file || !std::getline(file, list))
+                continue;
+
+            std::vector<int>    cpus = _ParseCpuList(list);
+            if (!cpus.empty())      // skip memory-only nodes
+            {
+                m_nodeCpus.push_back(cpus);
+                m_nodeIds.push_back(nodeId);
+            }
+        }
+    }
+#endif
+
+    // no NUMA information: one node holding every cpu
+    if (m_nodeCpus.empty())
+    {
+        std::vector<int>    cpus;
+        for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++)
+            cpus.push_back(cpu);
+        m_nodeCpus.push_back(cpus);
+        m_nodeIds.assign(1, 0);
+    }
+}
+
+//----------------------------------------------------
+
+const CCpuTopology&     CCpuTopology::Get()
+{
+    static const CCpuTopology   topology;
+    return topology;
+}
+
+//----------------------------------------------------
+
+bool    CCpuTopology::PinCurrentThread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t   set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+//----------------------------------------------------
+
+int     CCpuTopology::GetCurrentNode()
+{
+    return t_numaNode;
+}
+
+//----------------------------------------------------
+
+void    CCpuTopology::SetCurrentNode(int node)
+{
+    t_numaNode = node;
+}
+
+//----------------------------------------------------
+
+void*   CCpuTopology::AllocOnNode(size_t bytes, int node)
+{
+#if defined(__linux__)
+    void    *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    // best effort, pages stay first-touch placed if the kernel refuses.
+    // The mask is sized for the kernel id, which may be past 63.
+    const std::vector<int>  &nodeIds = Get().m_nodeIds;
+    if (node >= 0 && node < (int)nodeIds.size())
+    {
+        const size_t                bitsPerLong = sizeof(unsigned long) * 8;
+        const size_t                nodeId = nodeIds[node];
+        std::vector<unsigned long>  nodeMask(nodeId / bitsPerLong + 1, 0);
+        nodeMask[nodeId / bitsPerLong] |= 1ul << (nodeId % bitsPerLong);
+
+        // the kernel reads "maxnode - 1" bits of the mask
+        syscall(SYS_mbind, ptr, bytes, MPOL_BIND, nodeMask.data(), nodeMask.size() * bitsPerLong + 1, 0);
+    }
+
+    return ptr;
+#else
+    return ::operator new(bytes);
+#endif
+}
+
+//----------------------------------------------------
+
+void    CCpuTopology::FreeOnNode(void *ptr, size_t bytes)
+{
+    if (ptr == nullptr)
+        return;
+
+#if defined(__linux__)
+    munmap(ptr, bytes);
+#else
+    ::operator delete(ptr);
+#endif
+}
+
+//----------------------------------------------------
+_CR_NAMESPACE_END
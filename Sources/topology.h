@@ -0,0 +1,49 @@
+#pragma once
+
+/*************************************************************************
+*
+*		topology.h
+*
+*		CPU / NUMA topology helpers. Reads the node layout from sysfs
+*		and uses the raw affinity / mbind syscalls on Linux, so there
+*		is no libnuma dependency. Other platforms report a single
+*		node and pinning becomes a no-op.
+*
+**************************************************************************/
+
+#include "common.h"
+
+_CR_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Nodes are numbered 0..GetNodeCount()-1 over the nodes that have cpus, the
+// kernel ids may be sparse (memory-only nodes, offline nodes).
+class CCpuTopology
+{
+public:
+    static const CCpuTopology&  Get();
+
+    u_int32_t   GetNodeCount() const { return (u_int32_t)m_nodeCpus.size(); }
+    const std::vector<int>&     GetNodeCpus(int node) const { return m_nodeCpus[node]; }
+
+    // bind the calling thread to a single cpu
+    static bool     PinCurrentThread(int cpu);
+
+    // NUMA node of the calling thread, as assigned by the thread pool
+    static int      GetCurrentNode();
+    static void     SetCurrentNode(int node);
+
+    // page-aligned allocation bound to a NUMA node, falls back to plain
+    // allocation when binding is not available. nullptr when out of memory.
+    static void*    AllocOnNode(size_t bytes, int node);
+    static void     FreeOnNode(void *ptr, size_t bytes);
+
+private:
+    CCpuTopology();
+
+    std::vector<std::vector<int>>   m_nodeCpus;
+    std::vector<int>                m_nodeIds;      // kernel id of every node
+};
+
+//----------------------------------------------------
+_CR_NAMESPACE_END